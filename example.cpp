@@ -0,0 +1,25 @@
+// Runs a short write/read probe in-process with libsbench and prints the structured results instead of the usual
+// console output. Build with "make example", run as "./example [scratch_file]".
+#include <iomanip>
+#include <iostream>
+#include <memory>
+
+#include "sbench.h"
+
+int main(int argc, char **argv)
+{
+    sbench::Context p;
+    p.outfile = argc > 1 ? argv[1] : "sbench_probe.tmp";
+    p.mb = 64;
+    p.pattern = sbench::AccessPattern::parse("uniform");
+    p.results = std::make_shared<sbench::ResultsLog>();
+
+    sbench::setOutput(nullptr); // quiet, we print the results ourselves
+    const int res = sbench::run(p);
+
+    for (const sbench::PhaseResult & r : p.results->phases())
+        std::cout << std::left << std::setw(8) << r.name << std::right << std::fixed << std::setprecision(2)
+                  << std::setw(10) << r.mbPerSec << " MB/sec, " << std::setw(8) << (r.secs > 0. ? r.ops / r.secs : 0.)
+                  << " IOPS, p99 " << r.lat.percentile(99.) * 1e6 << " us" << (r.partial ? " (partial)" : "") << std::endl;
+    return res;
+}
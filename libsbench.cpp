@@ -0,0 +1,3474 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+#ifdef __APPLE__
+#include <copyfile.h>
+#include <sys/disk.h>
+#include <sys/ioctl.h>
+#endif
+
+#include "sbench.h"
+
+namespace sbench {
+    namespace {
+        std::atomic<bool> interrupted{false}; // set by interrupt(), e.g. when SIGINT is received
+        std::ostream *output = &std::cout; // see setOutput()
+
+        // the stream progress messages and results are printed to
+        std::ostream & out();
+
+        // returns relative time since program start in seconds (uses the clock chosen by timeSource())
+        double getTime();
+
+        // The clock behind getTime(), chosen and measured on first use: the TSC if it is invariant and the kernel
+        // trusts it (so its rate is constant and in sync across CPUs), else CLOCK_MONOTONIC_RAW.
+        struct TimeSource
+        {
+            bool tsc = false;
+            double secsPerTick = 1e-9;
+            std::uint64_t tsc0 = 0;
+            std::int64_t ns0 = 0;
+            double readCost = 0., resolution = 0.; // seconds
+        };
+        const TimeSource & timeSource();
+        std::int64_t monotonicNs();
+
+        // a latency measured with getTime() less the cost of the clock read itself
+        double netLatency(double secs) { return std::max(0., secs - timeSource().readCost); }
+
+        // prints the CPU cost of a phase as CPU-microseconds per I/O and CPU-milliseconds per GB
+        void printCpuCost(const CpuUsage & u, size_t nOps, size_t nBytes);
+
+        // Optional per-phase performance counters (cycles, instructions, cache misses, dTLB misses, context switches),
+        // read directly via perf_event_open(2) so no external perf tooling is needed. Only available on Linux;
+        // elsewhere (or if the kernel refuses) it prints why and does nothing.
+        class PerfCounters
+        {
+        public:
+            explicit PerfCounters(bool enabled);
+            ~PerfCounters();
+
+            void start();
+            void stop();
+            void print(size_t nOps) const;
+
+        private:
+            struct Counter { const char *name; int fd; std::uint64_t value; };
+            static constexpr int NCOUNTERS = 5;
+            Counter ctrs[NCOUNTERS] = {};
+            bool enabled, userOnly = false;
+        };
+
+        // Live progress for long phases (--progress). The I/O loops only bump relaxed atomic counters, so no locks or
+        // syscalls are added to the hot path; a reporter thread samples them every interval and prints one line with
+        // the current MB/sec and IOPS, the percentage done and the ETA.
+        class ProgressReporter
+        {
+        public:
+            ProgressReporter(double interval, std::uint64_t totalBytes); // interval <= 0 disables it
+            ~ProgressReporter() { stop(); }
+
+            void add(std::uint64_t bytes)
+            {
+                if (!active)
+                    return;
+                doneBytes.fetch_add(bytes, std::memory_order_relaxed);
+                doneOps.fetch_add(1, std::memory_order_relaxed);
+            }
+            void start(); // starts the reporter thread, call right before the phase's I/O loop
+            void stop(); // joins the reporter thread; call before printing the phase's results
+            const std::vector<ProgressSample> & samples() const { return series; } // valid after stop()
+
+        private:
+            const double interval;
+            const std::uint64_t total;
+            const bool active;
+            std::atomic<std::uint64_t> doneBytes{0}, doneOps{0};
+            std::mutex mut;
+            std::condition_variable cond;
+            bool stopping = false;
+            std::vector<ProgressSample> series;
+            std::thread thr;
+
+            void run();
+        };
+
+        // builds the PhaseResult of a phase that just finished (or was interrupted)
+        PhaseResult makeResult(const std::string & name, double secs, std::uint64_t bytes, const CpuUsage & cpu,
+                               const LatencyHistogram & lat, const ProgressReporter & progress);
+        // likewise, and logs it if --results was given
+        PhaseResult logResult(const Context & p, const std::string & name, double secs, std::uint64_t bytes,
+                              const CpuUsage & cpu, const LatencyHistogram & lat, const ProgressReporter & progress);
+
+        // appended to a phase's "took ..." line when its figures are partial
+        const char *partialNote() { return interrupted ? " [partial: interrupted]" : ""; }
+
+        // formats a duration given in seconds using the most readable unit (ns, us, ms, s)
+        std::string fmtDuration(double secs);
+
+        // Turns off OS caching for fd: F_NOCACHE on macOS, O_DIRECT elsewhere (which requires buffers from
+        // allocBuffer()). Returns 0 on success.
+        int setNoCache(int fd);
+
+        // waits until written data is on the device (F_FULLFSYNC on macOS, fsync elsewhere)
+        int fullSync(int fd);
+
+        // evicts outfile's data from the read cache, returns 0 on success
+        int purgeReadCache(const Context & p);
+
+        // true if path names an existing block or character device, which is written in place rather than created
+        bool isDevice(const std::string & path);
+
+        // Bytes of fd the read passes cover: the first SIZE_MB, or less if the file or device is smaller. A block
+        // device's size comes from the driver (BLKGETSIZE64, DKIOCGETBLOCKCOUNT on macOS), as st_size is 0 for it.
+        std::uint64_t testRegion(const Context & p, int fd);
+
+        // Reads "name value" lines from a /proc file such as /proc/meminfo or /proc/vmstat (a ':' after the name is
+        // ignored), storing the value of each of names into vals. Returns false if the file cannot be read (macOS).
+        bool readProcValues(const char *path, const std::vector<const char *> & names,
+                            std::vector<std::uint64_t> & vals);
+
+        // fraction of the first size bytes of fd that are resident in the page cache (mincore), or -1 if unknown
+        double residentFraction(int fd, size_t size);
+
+        // heap buffer aligned for direct I/O
+        using Buffer = std::unique_ptr<char[], void(*)(void *)>;
+        Buffer allocBuffer(size_t size);
+
+        // fills buf with size bytes of FastRng output from seed: incompressible data, reproducible from the seed
+        void fillRandom(char *buf, size_t size, std::uint64_t seed);
+
+        // Source of the iovec arrays for the read and write loops. With one iovec it just points at the caller's
+        // buffer; with more (--iovecs) each request is gathered from separately allocated segments, cycling through a
+        // pool several requests deep so consecutive requests touch different memory, as a storage engine writing out
+        // scattered pages.
+        class IoVecPool
+        {
+        public:
+            IoVecPool(size_t nIov, char *buf, size_t reqSize); // segments are initialized with a copy of buf
+            const struct iovec *next();
+            int count() const { return int(nIov); }
+
+        private:
+            static constexpr size_t DEPTH = 4; // requests' worth of segments in the pool
+            size_t nIov, cur = 0;
+            std::vector<Buffer> segs;
+            std::vector<struct iovec> iovs;
+        };
+
+        // the I/O calls used by the read and write loops: plain read()/write() for one iovec, readv()/writev() for
+        // several, or preadv2()/pwritev2() with RWF_HIPRI when polled completions were requested. off < 0 means the
+        // current file offset, otherwise the positional variants are used.
+        ssize_t readBlock(const Context & p, int fd, const struct iovec *iov, int iovcnt, off_t off = -1);
+        ssize_t writeBlock(const Context & p, int fd, const struct iovec *iov, int iovcnt, off_t off = -1);
+
+        // small, fast PRNG (splitmix64) for the per-I/O paths, where mt19937_64 would be needlessly slow
+        struct FastRng
+        {
+            std::uint64_t state;
+
+            explicit FastRng(std::uint64_t seed) : state(seed) {}
+            std::uint64_t next()
+            {
+                std::uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+                return z ^ (z >> 31);
+            }
+            double uniform() { return (next() >> 11) * 0x1.0p-53; } // [0, 1)
+            std::uint64_t below(std::uint64_t n) { return std::uint64_t((unsigned __int128)next() * n >> 64); } // [0, n)
+        };
+
+        // Generates fresh write payloads per block for --compress/--dedupe, in 4 KB chunks (the usual dedupe
+        // granularity). A chunk is either a copy of one of a small library of chunks (dedupe percent of the time) or
+        // new data whose first 1/ratio is random and the rest zeros, which compressors (and compressing controllers)
+        // shrink to about the target ratio. Only the random part costs PRNG output, so a block is cheap to generate
+        // next to the cost of writing it.
+        class DataGenerator
+        {
+        public:
+            DataGenerator(double compressRatio, double dedupePct, std::uint64_t seed);
+            void fill(const struct iovec *iov, int iovcnt); // segments must be multiples of CHUNK bytes
+            std::string describe() const;
+
+            static constexpr size_t CHUNK = DATA_CHUNK;
+
+        private:
+            static constexpr size_t LIBRARY = 64; // chunks that duplicates are copied from
+            double ratio, dedupe;
+            size_t randomBytes; // per unique chunk, the rest is zeros
+            FastRng rng;
+            std::vector<char> library;
+
+            void fillChunk(char *dst);
+        };
+
+        // Draws block indices in [0, nBlocks) from an AccessPattern. Setup is O(nBlocks) (rank permutation and the zipf
+        // zeta constant), after which every sample is O(1) with no allocation, so the generator can keep up with
+        // millions of IOPS. Skewed distributions map their popularity ranks through a random permutation so hot blocks
+        // are scattered over the file the way hashed keys are, rather than all packed at its start.
+        class OffsetGenerator
+        {
+        public:
+            OffsetGenerator(const AccessPattern & pat, size_t nBlocks, std::uint64_t seed);
+            size_t next();
+            // restarts the sampling from seed, keeping the hot block permutation: concurrent workers copy one
+            // generator and reseed it, so they draw different offsets from the same distribution
+            void reseed(std::uint64_t seed) { rng = FastRng(seed); }
+
+        private:
+            AccessPattern pat;
+            size_t n;
+            FastRng rng;
+            std::vector<std::uint32_t> perm;
+            double zetan = 0., alpha = 0., eta = 0., halfPowTheta = 0.; // zipf
+            double loPow = 0., hiPow = 0.; // bounded pareto
+            double spare = 0.; bool haveSpare = false; // gaussian (Box-Muller makes two samples at a time)
+        };
+
+        // describes the I/O mode for progress messages, e.g. " (polled, 16 iovecs)", or "" for plain I/O
+        std::string modeDesc(const Context & p, bool readPass = false);
+
+        // Allocates size bytes for fd according to mode (a no-op for Extend). Linux uses fallocate(), macOS
+        // F_PREALLOCATE, which has no zero-range equivalent. Returns 0 on success, else -1 with errno set.
+        int preallocate(int fd, Prealloc mode, off_t size);
+
+        // Kind of like Go's "defer" statement. Call a functor (for clean-up code) at scope end.
+        struct Defer
+        {
+            std::function<void(void)> func;
+
+            Defer(const std::function<void(void)> & f) : func(f) {}
+            Defer(std::function<void(void)> && f) : func(std::move(f)) {}
+
+            ~Defer() { if (func) func(); }
+        };
+    } // end anonymous namespace
+
+    namespace {
+        std::ostream & out()
+        {
+            static std::ostream discard(nullptr); // a stream without a buffer ignores all output
+            return output ? *output : discard;
+        }
+
+        double getTime()
+        {
+            const TimeSource & s = timeSource();
+#if defined(__x86_64__) || defined(__i386__)
+            if (s.tsc)
+                return double(__rdtsc() - s.tsc0) * s.secsPerTick;
+#endif
+            return double(monotonicNs() - s.ns0) * 1e-9;
+        }
+
+        std::int64_t monotonicNs()
+        {
+#ifdef CLOCK_MONOTONIC_RAW
+            struct timespec ts;
+            ::clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+            return std::int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#else
+            const auto now = std::chrono::steady_clock::now().time_since_epoch();
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+#endif
+        }
+
+        const TimeSource & timeSource()
+        {
+            static const TimeSource src = [] {
+                TimeSource s;
+#if defined(__x86_64__) || defined(__i386__)
+                unsigned a, b, c, d;
+                // CPUID 0x80000007 EDX bit 8: the TSC ticks at a constant rate regardless of P- and C-states
+                s.tsc = __get_cpuid(0x80000007, &a, &b, &c, &d) && (d & (1u << 8));
+#ifdef __linux__
+                // the kernel also checks that the TSCs of all CPUs agree, and only then keeps it as its clocksource
+                std::ifstream f("/sys/devices/system/clocksource/clocksource0/current_clocksource");
+                std::string cs;
+                s.tsc = s.tsc && f >> cs && cs == "tsc";
+#endif
+                if (s.tsc) {
+                    // measure the tick rate against the monotonic clock
+                    const std::uint64_t c0 = __rdtsc();
+                    const std::int64_t n0 = monotonicNs();
+                    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                    s.secsPerTick = double(monotonicNs() - n0) * 1e-9 / double(__rdtsc() - c0);
+                    s.tsc0 = __rdtsc();
+                }
+#endif
+                s.ns0 = monotonicNs();
+
+                auto read = [&s] {
+#if defined(__x86_64__) || defined(__i386__)
+                    if (s.tsc)
+                        return double(__rdtsc() - s.tsc0) * s.secsPerTick;
+#endif
+                    return double(monotonicNs() - s.ns0) * 1e-9;
+                };
+                // best of several rounds, so an untimely interrupt or preemption does not inflate the figure
+                constexpr int N = 20000, ROUNDS = 5;
+                s.readCost = s.resolution = 1.;
+                for (int r = 0; r < ROUNDS; ++r) {
+                    const double t0 = read();
+                    double prev = t0;
+                    for (int i = 0; i < N; ++i) {
+                        const double t = read();
+                        if (t > prev)
+                            s.resolution = std::min(s.resolution, t - prev);
+                        prev = t;
+                    }
+                    s.readCost = std::min(s.readCost, (prev - t0) / N);
+                }
+                return s;
+            }();
+            return src;
+        }
+
+        int setNoCache(int fd)
+        {
+#ifdef F_NOCACHE
+            return ::fcntl(fd, F_NOCACHE, 1);
+#else
+            const int flags = ::fcntl(fd, F_GETFL);
+            return flags < 0 ? flags : ::fcntl(fd, F_SETFL, flags | O_DIRECT);
+#endif
+        }
+
+        int fullSync(int fd)
+        {
+#ifdef F_FULLFSYNC
+            return ::fcntl(fd, F_FULLFSYNC, 1);
+#else
+            return ::fsync(fd);
+#endif
+        }
+
+        bool isDevice(const std::string & path)
+        {
+            struct stat st;
+            return ::stat(path.c_str(), &st) == 0 && (S_ISBLK(st.st_mode) || S_ISCHR(st.st_mode));
+        }
+
+        std::uint64_t testRegion(const Context & p, int fd)
+        {
+            struct stat st;
+            if (::fstat(fd, &st))
+                return 0;
+            std::uint64_t size = std::uint64_t(st.st_size);
+            if (S_ISBLK(st.st_mode)) {
+                size = 0;
+#if defined(__linux__)
+                if (::ioctl(fd, BLKGETSIZE64, &size))
+                    size = 0;
+#elif defined(DKIOCGETBLOCKCOUNT)
+                std::uint64_t count = 0;
+                std::uint32_t blockSize = 0;
+                if (!::ioctl(fd, DKIOCGETBLOCKCOUNT, &count) && !::ioctl(fd, DKIOCGETBLOCKSIZE, &blockSize))
+                    size = count * blockSize;
+#endif
+            }
+            return std::min<std::uint64_t>(size, p.mb * MB);
+        }
+
+        int purgeReadCache(const Context & p)
+        {
+#ifdef __APPLE__
+            (void)p;
+            out() << "Running /usr/sbin/purge with sudo (clearing read cache)..." << std::endl;
+            // purge command clears read caches
+            int res = std::system("/usr/bin/sudo /usr/sbin/purge");
+            if (res)
+                std::cerr << "Failed to execute purge, exit code: " << res << std::endl;
+            return res;
+#else
+            // no root needed here: dropping just this file's pages is enough
+            out() << "Dropping cached pages of " << p.outfile << " (clearing read cache)..." << std::endl;
+            int fd = ::open(p.outfile.c_str(), O_RDONLY | O_CLOEXEC);
+            int res = fd < 0 ? -1 : ::fdatasync(fd);
+            if (!res)
+                res = ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            if (fd >= 0)
+                ::close(fd);
+            if (res)
+                std::cerr << "Failed to drop cached pages of " << p.outfile << std::endl;
+            return res;
+#endif
+        }
+
+        bool readProcValues(const char *path, const std::vector<const char *> & names,
+                            std::vector<std::uint64_t> & vals)
+        {
+            std::ifstream f(path);
+            if (!f)
+                return false;
+            vals.assign(names.size(), 0);
+            std::string name;
+            std::uint64_t val;
+            while (f >> name >> val) {
+                if (!name.empty() && name.back() == ':')
+                    name.pop_back();
+                for (size_t i = 0; i < names.size(); ++i)
+                    if (name == names[i])
+                        vals[i] = val;
+                f.ignore(std::numeric_limits<std::streamsize>::max(), '\n'); // skip a unit such as "kB"
+            }
+            return true;
+        }
+
+        double residentFraction(int fd, size_t size)
+        {
+            if (!size)
+                return -1.;
+            void *addr = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+            if (addr == MAP_FAILED)
+                return -1.;
+            const size_t page = size_t(::sysconf(_SC_PAGESIZE)), nPages = (size + page - 1) / page;
+            std::vector<unsigned char> vec(nPages);
+#ifdef __APPLE__
+            const int res = ::mincore(addr, size, reinterpret_cast<char *>(vec.data()));
+#else
+            const int res = ::mincore(addr, size, vec.data());
+#endif
+            ::munmap(addr, size);
+            if (res)
+                return -1.;
+            return double(std::count_if(vec.begin(), vec.end(), [](unsigned char v) { return v & 1; })) / nPages;
+        }
+
+        Buffer allocBuffer(size_t size)
+        {
+            void *mem = nullptr;
+            if (::posix_memalign(&mem, 4096, size))
+                throw std::bad_alloc();
+            return Buffer(static_cast<char *>(mem), std::free);
+        }
+
+        void fillRandom(char *buf, size_t size, std::uint64_t seed)
+        {
+            FastRng rng(seed);
+            for (size_t i = 0; i < size; i += sizeof(std::uint64_t)) {
+                const std::uint64_t v = rng.next();
+                std::memcpy(buf + i, &v, std::min(sizeof(v), size - i));
+            }
+        }
+
+        ssize_t readBlock(const Context & p, int fd, const struct iovec *iov, int iovcnt, off_t off)
+        {
+#ifdef RWF_HIPRI
+            if (p.polled)
+                return ::preadv2(fd, iov, iovcnt, off, RWF_HIPRI);
+#else
+            (void)p;
+#endif
+            if (off < 0)
+                return iovcnt == 1 ? ::read(fd, iov->iov_base, iov->iov_len) : ::readv(fd, iov, iovcnt);
+            return iovcnt == 1 ? ::pread(fd, iov->iov_base, iov->iov_len, off) : ::preadv(fd, iov, iovcnt, off);
+        }
+
+        ssize_t writeBlock(const Context & p, int fd, const struct iovec *iov, int iovcnt, off_t off)
+        {
+#ifdef RWF_HIPRI
+            if (p.polled)
+                return ::pwritev2(fd, iov, iovcnt, off, RWF_HIPRI);
+#else
+            (void)p;
+#endif
+            if (off < 0)
+                return iovcnt == 1 ? ::write(fd, iov->iov_base, iov->iov_len) : ::writev(fd, iov, iovcnt);
+            return iovcnt == 1 ? ::pwrite(fd, iov->iov_base, iov->iov_len, off) : ::pwritev(fd, iov, iovcnt, off);
+        }
+
+        int preallocate(int fd, Prealloc mode, off_t size)
+        {
+            switch (mode) {
+            case Prealloc::Extend:
+                return 0;
+            case Prealloc::Sparse:
+                return ::ftruncate(fd, size);
+#ifdef __linux__
+            case Prealloc::Alloc:
+                return ::fallocate(fd, 0, 0, size);
+            case Prealloc::KeepSize:
+                return ::fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size);
+            case Prealloc::ZeroRange:
+                return ::fallocate(fd, FALLOC_FL_ZERO_RANGE, 0, size);
+#elif defined(F_PREALLOCATE)
+            case Prealloc::Alloc:
+            case Prealloc::KeepSize: {
+                // try for a contiguous allocation first, like fallocate does on most filesystems, then settle for any
+                fstore_t fst = { F_ALLOCATECONTIG | F_ALLOCATEALL, F_PEOFPOSMODE, 0, size, 0 };
+                if (::fcntl(fd, F_PREALLOCATE, &fst) == -1) {
+                    fst.fst_flags = F_ALLOCATEALL;
+                    if (::fcntl(fd, F_PREALLOCATE, &fst) == -1)
+                        return -1;
+                }
+                return mode == Prealloc::Alloc ? ::ftruncate(fd, size) : 0;
+            }
+#endif
+            default:
+                errno = ENOTSUP;
+                return -1;
+            }
+        }
+
+        std::string modeDesc(const Context & p, bool readPass)
+        {
+            std::string ret;
+            if (p.polled)
+                ret += "polled";
+            if (p.iovecs > 1)
+                ret += (ret.empty() ? "" : ", ") + std::to_string(p.iovecs) + " iovecs";
+            if (!readPass && p.prealloc != Prealloc::Extend)
+                ret += (ret.empty() ? "" : ", ") + std::string("into ") + preallocName(p.prealloc) + " file";
+            if (readPass && p.pattern.kind != AccessPattern::Seq)
+                ret += (ret.empty() ? "" : ", ") + p.pattern.describe();
+            return ret.empty() ? ret : " (" + ret + ")";
+        }
+
+        PhaseResult makeResult(const std::string & name, double secs, std::uint64_t bytes, const CpuUsage & cpu,
+                               const LatencyHistogram & lat, const ProgressReporter & progress)
+        {
+            PhaseResult r;
+            r.name = name;
+            r.secs = secs;
+            r.bytes = bytes;
+            r.ops = lat.count();
+            r.mbPerSec = secs > 0. ? bytes / double(MB) / secs : 0.;
+            r.partial = interrupted;
+            r.cpu = cpu;
+            r.lat = lat;
+            r.series = progress.samples();
+            return r;
+        }
+
+        PhaseResult logResult(const Context & p, const std::string & name, double secs, std::uint64_t bytes,
+                              const CpuUsage & cpu, const LatencyHistogram & lat, const ProgressReporter & progress)
+        {
+            const PhaseResult r = makeResult(name, secs, bytes, cpu, lat, progress);
+            if (p.results)
+                p.results->add(r);
+            return r;
+        }
+
+        std::string fmtDuration(double secs)
+        {
+            std::ostringstream os;
+            os << std::fixed << std::setprecision(secs < 1e-6 ? 0 : 2);
+            if (secs < 1e-6)
+                os << secs * 1e9 << "ns";
+            else if (secs < 1e-3)
+                os << secs * 1e6 << "us";
+            else if (secs < 1.)
+                os << secs * 1e3 << "ms";
+            else
+                os << secs << "s";
+            return os.str();
+        }
+
+        void printCpuCost(const CpuUsage & u, size_t nOps, size_t nBytes)
+        {
+            const double total = u.user + u.sys;
+            const double GB = double(MB) * 1024.;
+            out() << "    CPU: " << std::fixed << std::setprecision(3) << u.user << "s user + " << u.sys << "s sys";
+            if (nOps)
+                out() << " (" << std::setprecision(2) << (total * 1e6 / nOps) << " us/IO";
+            if (nOps && nBytes)
+                out() << ", " << (total * 1e3 / (nBytes / GB)) << " ms/GB";
+            if (nOps)
+                out() << ")";
+            out() << ", context switches: " << u.volCsw << " voluntary, " << u.involCsw << " involuntary" << std::endl;
+        }
+    } // end anonymous namespace
+
+    int run(Context & p)
+    {
+        Defer defer_RmOutfile([&p]{
+            if (p.outfileCreated && !isDevice(p.outfile)) { // never remove a device node, whatever opened it
+                if (unlink(p.outfile.c_str())) {
+                    std::cerr << "Failed to remove file " << p.outfile << std::endl;
+                } else {
+                    p.outfileCreated = false;
+                    std::cerr << "(Removed " << p.outfile << ")" << std::endl;
+                }
+            }
+        });
+
+        // --membw and --extents relate the other phases' figures, so they need them logged even without --results
+        if ((!p.resultsFile.empty() || p.memBandwidth || p.extents) && !p.results)
+            p.results = std::make_shared<ResultsLog>();
+
+        const Calibration & cal = calibration();
+        out() << "Calibration: clock " << cal.clock << " (" << std::fixed << std::setprecision(3) << cal.clockHz / 1e9
+              << " GHz, " << fmtDuration(cal.clockRead) << "/read, subtracted from latencies), null syscall "
+              << fmtDuration(cal.nullSyscall) << ", memcpy " << std::setprecision(2) << cal.memcpyBytesPerSec / 1e9
+              << " GB/sec" << std::endl;
+
+        Defer defer_SaveResults([&p]{
+            if (p.results && !p.resultsFile.empty() && p.results->save(p.resultsFile, p))
+                out() << "(Wrote results to " << p.resultsFile << ")" << std::endl;
+        });
+
+        if (p.memBandwidth) {
+            if (int res = doMemBandwidth(p))
+                return res;
+        }
+
+        Defer defer_MemFraction([&p]{
+            if (!p.memBandwidth)
+                return;
+            const auto & phases = p.results->phases();
+            const auto it = std::find_if(phases.begin(), phases.end(), [](const PhaseResult & r) {
+                return r.name == "membw-memcpy";
+            });
+            if (it == phases.end() || it->mbPerSec <= 0.)
+                return;
+            out() << "I/O throughput as a fraction of memcpy bandwidth (" << std::fixed << std::setprecision(2)
+                  << it->mbPerSec / 1024. << " GB/sec):" << std::endl;
+            for (const PhaseResult & r : phases)
+                if (r.bytes && r.name.compare(0, 6, "membw-"))
+                    out() << "    " << std::left << std::setw(24) << r.name << std::right << std::setw(10) << r.mbPerSec
+                          << " MB/sec" << std::setprecision(1) << std::setw(7) << r.mbPerSec / it->mbPerSec * 100. << "%"
+                          << std::setprecision(2) << std::endl;
+        });
+
+        if (p.metadataFiles)
+            return doMetadata(p);
+
+        if (!p.targets.empty())
+            return doTargets(p);
+
+        if (p.buffered)
+            return doBuffered(p);
+
+        if (p.stallSecs > 0.)
+            return doStalls(p);
+
+        if (p.appendRecord)
+            return doAppendLog(p);
+
+        if (p.tail)
+            return doTail(p);
+
+        if (!p.recordFile.empty())
+            p.recorder = std::make_shared<TraceRecorder>();
+
+        int res;
+        if (p.preallocCompare) {
+            std::vector<std::pair<Prealloc, PhaseResult>> results;
+            for (const Prealloc mode : preallocModes()) {
+                p.prealloc = mode;
+                PhaseResult r;
+                if ( (res = doWrite(p, &r)) )
+                    return res;
+                results.emplace_back(mode, r);
+            }
+            out() << "Write throughput by allocation mode:" << std::endl;
+            for (const auto & r : results)
+                out() << "    " << std::left << std::setw(24) << preallocName(r.first) << std::right << std::fixed
+                      << std::setprecision(2) << std::setw(10) << r.second.mbPerSec << " MB/sec" << std::endl;
+        } else {
+            res = p.syncRangeMB ? doSyncRangeWrite(p) : doWrite(p);
+        }
+        if (!res && p.overwrite)
+            res = doWrite(p, nullptr, WritePass::OverwriteSeq);
+        if (!res && p.overwrite)
+            res = doWrite(p, nullptr, WritePass::OverwriteRandom);
+        if (!res && p.discardChunkMB) {
+            res = doDiscard(p);
+            if (!res) {
+                res = doWrite(p, nullptr, WritePass::AfterDiscard);
+            }
+        }
+        ExtentLayout layout;
+        if (!res && p.extents) {
+            if (extentLayout(p.outfile, layout)) {
+                out() << "Extent layout: " << layout.extents << " extents (avg " << std::fixed << std::setprecision(2)
+                      << layout.avgExtent() / MB << " MB) in " << layout.runs << " physically contiguous run(s) (avg "
+                      << layout.avgRun() / MB << " MB)" << std::endl;
+                p.results->setLayout(layout);
+            } else {
+                std::cerr << "Extent layout unavailable (" << std::strerror(errno) << ")" << std::endl;
+            }
+        }
+        if (!res && p.copy)
+            res = doCopy(p);
+        if (res)
+            return res;
+        const size_t nPhases = p.results ? p.results->phases().size() : 0;
+        res = p.scaleMax ? doScale(p) : p.replayFile.empty() ? doRead(p) : doReplay(p);
+        if (layout.extents && p.results->phases().size() > nPhases) {
+            const PhaseResult & r = p.results->phases().back();
+            out() << "Read throughput against layout: " << std::fixed << std::setprecision(2) << r.mbPerSec
+                  << " MB/sec (" << r.name << ") over " << layout.extents << " extents, " << layout.runs
+                  << " contiguous run(s)" << std::endl;
+        }
+
+        if (!res && p.recorder) {
+            if (p.recorder->save(p.recordFile))
+                out() << "(Recorded I/O trace to " << p.recordFile << ")" << std::endl;
+            else
+                res = 4;
+        }
+
+        return res;
+    }
+
+    void interrupt() { interrupted = true; }
+    bool isInterrupted() { return interrupted; }
+    void clearInterrupt() { interrupted = false; }
+
+    void setOutput(std::ostream *os) { output = os; }
+
+    const Calibration & calibration()
+    {
+        static const Calibration cal = [] {
+            Calibration c;
+            const TimeSource & ts = timeSource();
+            c.clock = ts.tsc ? "tsc" : "monotonic_raw";
+            c.clockHz = 1. / ts.secsPerTick;
+            c.clockRead = ts.readCost;
+            c.clockResolution = ts.resolution;
+
+            constexpr int N = 10000, ROUNDS = 5;
+            c.nullSyscall = 1.;
+            for (int r = 0; r < ROUNDS; ++r) {
+                const double t0 = getTime();
+                for (int i = 0; i < N; ++i) {
+#ifdef __linux__
+                    ::syscall(SYS_getppid); // bypass any caching in libc
+#else
+                    ::getppid();
+#endif
+                }
+                c.nullSyscall = std::min(c.nullSyscall, (getTime() - t0) / N);
+            }
+
+            // copy a span larger than the caches in BUFSZ blocks, the size the read and write loops use
+            constexpr size_t SPAN = 64 * MB;
+            auto src = allocBuffer(SPAN), dst = allocBuffer(SPAN);
+            std::memset(src.get(), 1, SPAN);
+            std::memset(dst.get(), 0, SPAN);
+            for (int r = 0; r < 3; ++r) {
+                const double t0 = getTime();
+                for (size_t off = 0; off < SPAN; off += BUFSZ)
+                    std::memcpy(dst.get() + off, src.get() + off, BUFSZ);
+                asm volatile("" : : "r"(dst.get()) : "memory"); // keep the copies from being optimized away
+                c.memcpyBytesPerSec = std::max(c.memcpyBytesPerSec, SPAN / (getTime() - t0));
+            }
+            return c;
+        }();
+        return cal;
+    }
+
+    bool polledSupported()
+    {
+#ifdef RWF_HIPRI
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    int doRead(const Context & p)
+    {
+        int res = purgeReadCache(p);
+        if (res)
+            return res;
+        out() << "Reading back " << p.outfile << modeDesc(p, true) << "..." << std::flush;
+        int fd = ::open(p.outfile.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            std::cerr << "\nError opening file" << std::endl;
+            return 10;
+        }
+
+        Defer defer_CloseFd([&fd]{
+            if (fd >= 0) {
+                ::close(fd);
+                fd = -1;
+            }
+        });
+
+        res = setNoCache(fd);  // turn off read cache
+        if (res) {
+            std::cerr << "\nsetNoCache returned " << res << std::endl;
+            return 11;
+        }
+
+        auto buf = allocBuffer(BUFSZ); // we allocate data on the heap, BUFSZ bytes
+        IoVecPool pool(p.iovecs, buf.get(), BUFSZ);
+        size_t count = 0, nOps = 0;
+        ssize_t nread = 0;
+        LatencyHistogram lat;
+
+        // random patterns issue as many reads as there are blocks in the test region, at offsets drawn from the pattern
+        const bool sequential = p.pattern.kind == AccessPattern::Seq;
+        const size_t nBlocks = size_t(testRegion(p, fd) / BUFSZ);
+        std::unique_ptr<OffsetGenerator> gen;
+        if (!sequential && nBlocks)
+            gen = std::make_unique<OffsetGenerator>(p.pattern, nBlocks, std::uint64_t(getTime() * 1e9) ^ ::getpid());
+
+        PerfCounters perf(p.counters);
+        const CpuUsage cpu0 = CpuUsage::now();
+        perf.start();
+        ProgressReporter progress(p.progressInterval, std::uint64_t(nBlocks) * BUFSZ);
+        progress.start();
+        double t0 = getTime(), tio = t0;
+
+        for (size_t i = 0; !interrupted && i < nBlocks; ++i) {
+            const off_t off = sequential ? -1 : off_t(gen->next() * BUFSZ);
+            if ( (nread = readBlock(p, fd, pool.next(), pool.count(), off)) <= 0)
+                break;
+            const double t = getTime();
+            lat.add(netLatency(t - tio));
+            if (p.recorder)
+                p.recorder->add(tio, 'R', sequential ? count : std::uint64_t(off), std::uint64_t(nread));
+            tio = t;
+            count += nread;
+            ++nOps;
+            progress.add(std::uint64_t(nread));
+        }
+
+        perf.stop();
+        progress.stop();
+
+        if (count) {
+            const double elapsed = getTime() - t0;
+            const CpuUsage cpu = CpuUsage::now() - cpu0;
+            const double n_MB = count/double(MB);
+            out() << "took " << std::fixed << std::setprecision(3) << elapsed << " secs (" << std::setprecision(2) << (n_MB/elapsed) << " MB/sec)" << partialNote() << std::endl;
+            printCpuCost(cpu, nOps, count);
+            lat.print();
+            perf.print(nOps);
+            logResult(p, "read", elapsed, count, cpu, lat, progress);
+        } else if (!interrupted) {
+            std::cerr << "Error reading!" << std::endl;
+            return 20;
+        }
+
+        return interrupted ? 99 : 0;
+    }
+
+    int doWrite(Context & p, PhaseResult *result, WritePass pass)
+    {
+        const size_t N = p.mb * MB;
+
+        if (N < BUFSZ) {
+            std::cerr << "Invalid output size specified: " << N << std::endl;
+            return 2;
+        }
+
+        struct MyFailure : public std::runtime_error {
+            using std::runtime_error::runtime_error; // explicitly inherit c'tor
+        };
+
+        double t0; // starts off uninitialized but will be initialized once we begin writing below...
+        CpuUsage cpu0; // likewise, snapshot taken when writing begins
+        PerfCounters perf(p.counters);
+        LatencyHistogram lat;
+        ProgressReporter progress(p.progressInterval, N);
+        size_t written = 0;
+        double fillerSecs = 0.; // time spent writing the --fragment filler, left out of the phase
+
+        const bool fresh = pass == WritePass::Fresh;
+
+        try {
+            // a device is written in place: it is never created, truncated, or removed by run()
+            const bool device = isDevice(p.outfile);
+            int fd = fresh && !device
+                         ? ::open(p.outfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR)
+                         : ::open(p.outfile.c_str(), O_WRONLY | O_CLOEXEC);
+            if (fd < 0)
+                throw MyFailure("cannot open file for writing");
+            if (!device)
+                p.outfileCreated = true;
+
+            Defer defered_close([&fd]{
+                if (fd >= 0) {
+                    ::close(fd);
+                    fd = -1;
+                }
+            });
+
+            if (setNoCache(fd))
+                throw MyFailure("failed to disable write caching");
+
+            if (fresh && p.prealloc != Prealloc::Extend) {
+                out() << "Allocating " << p.mb << " MB (" << preallocName(p.prealloc) << ")..." << std::flush;
+                const double t0 = getTime();
+                if (preallocate(fd, p.prealloc, off_t(N)))
+                    throw MyFailure(std::string("preallocation failed: ") + std::strerror(errno));
+                out() << "took " << std::fixed << std::setprecision(3) << (getTime()-t0) << " seconds" << std::endl;
+            }
+
+            // With --fragment a filler file takes a block after every fragmentMB of this one, competing for the same
+            // free space while both grow; removing it afterwards leaves the test file in runs of about that size.
+            const std::string fillerName = p.outfile + ".filler";
+            int fillerFd = -1;
+            Defer defered_filler([&fillerFd, &fillerName]{
+                if (fillerFd >= 0) {
+                    ::close(fillerFd);
+                    ::unlink(fillerName.c_str());
+                }
+            });
+            if (fresh && p.fragmentMB) {
+                fillerFd = ::open(fillerName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+                if (fillerFd < 0)
+                    throw MyFailure("cannot create filler file " + fillerName);
+                if (setNoCache(fillerFd))
+                    throw MyFailure("failed to disable write caching on filler file");
+            }
+            const size_t fillerEvery = std::max<size_t>(p.fragmentMB * MB / BUFSZ, 1);
+
+            auto buf = allocBuffer(BUFSZ); // we allocate data on the heap, BUFSZ bytes
+
+            {   // assign random data to buf
+                out() << "Generating random data..." << std::flush;
+                double t0 = getTime();
+                std::mt19937_64 rgen;
+                rgen.seed(std::chrono::system_clock::now().time_since_epoch().count());
+                std::uniform_int_distribution<std::uint64_t> dist(0);
+                std::uint64_t *words = reinterpret_cast<std::uint64_t *>(buf.get());
+                for (size_t i = 0; i < BUFSZ/sizeof(*words); ++i) {
+                    words[i] = dist(rgen);
+                }
+                out() << "took " << std::fixed << std::setprecision(3) << (getTime()-t0) << " seconds" << std::endl;
+            }
+
+            IoVecPool pool(p.iovecs, buf.get(), BUFSZ);
+
+            // with a data profile every block gets fresh payload instead of rewriting the one random buffer
+            std::unique_ptr<DataGenerator> dataGen;
+            if (p.compress > 1. || p.dedupe > 0.) {
+                dataGen = std::make_unique<DataGenerator>(p.compress, p.dedupe, std::uint64_t(getTime() * 1e9));
+                out() << "Data profile: " << dataGen->describe() << ", generated per block" << std::endl;
+            }
+
+            // the random overwrite pass visits every block exactly once, in shuffled order
+            std::vector<size_t> order;
+            if (pass == WritePass::OverwriteRandom) {
+                order.resize(N/BUFSZ);
+                FastRng rng(std::uint64_t(getTime() * 1e9));
+                for (size_t i = 0; i < order.size(); ++i)
+                    order[i] = i;
+                for (size_t i = order.size() - 1; i > 0; --i)
+                    std::swap(order[i], order[rng.below(i + 1)]);
+            }
+
+            if (fresh && fillerFd >= 0)
+                out() << "Writing " << p.mb << " MB to " << p.outfile << modeDesc(p) << ", interleaved with 1 MB of "
+                      << fillerName << " every " << p.fragmentMB << " MB..." << std::flush;
+            else if (fresh)
+                out() << "Writing " << p.mb << " MB to " << p.outfile << modeDesc(p) << "..." << std::flush;
+            else if (pass == WritePass::AfterDiscard)
+                out() << "Rewriting " << p.mb << " MB of " << p.outfile << " after discard" << modeDesc(p) << "..."
+                      << std::flush;
+            else
+                out() << "Overwriting " << p.mb << " MB of " << p.outfile << " in place, "
+                      << (order.empty() ? "sequential" : "random order") << modeDesc(p) << "..." << std::flush;
+
+            cpu0 = CpuUsage::now();
+            perf.start();
+            progress.start();
+            t0 = getTime(); // mark write start time
+            double tio = t0;
+
+            for (size_t i = 0; i < N/BUFSZ && !interrupted; ++i) {
+                const struct iovec *iov = pool.next();
+                if (dataGen) {
+                    dataGen->fill(iov, pool.count());
+                    tio = getTime(); // latency covers the I/O only, generation is still part of the throughput
+                }
+                const size_t block = order.empty() ? i : order[i];
+                auto n = writeBlock(p, fd, iov, pool.count(), order.empty() ? -1 : off_t(block * BUFSZ));
+                if (n <= 0)
+                    throw MyFailure("write failure");
+                const double t = getTime();
+                lat.add(netLatency(t - tio));
+                if (p.recorder)
+                    p.recorder->add(tio, 'W', block * BUFSZ, BUFSZ);
+                tio = t;
+                written += BUFSZ;
+                progress.add(BUFSZ);
+                if (fillerFd >= 0 && (i + 1) % fillerEvery == 0) {
+                    if (writeBlock(p, fillerFd, iov, pool.count(), -1) != ssize_t(BUFSZ))
+                        throw MyFailure("write failure on filler file");
+                    tio = getTime(); // the filler counts towards neither this file's throughput nor its latency
+                    fillerSecs += tio - t;
+                }
+            }
+            if (!interrupted) // stop promptly if interrupted, the partial figures then exclude the final flush
+                fullSync(fd); // wait for write buffers to write back to device.
+            perf.stop();
+            progress.stop();
+        } catch (const MyFailure &e) {
+            std::cerr << "Error on " <<  p.outfile << " (" << e.what() << ")" << std::endl;
+            return 3;
+        }
+
+        if (!written) // interrupted before anything was written: nothing to report
+            return 99;
+
+        const double elapsed = getTime() - t0 - fillerSecs;
+        const CpuUsage cpu = CpuUsage::now() - cpu0;
+        const double mbsec = written / double(MB) / elapsed;
+
+        out() << "took " << std::fixed << std::setprecision(3) << elapsed << " seconds"
+              << " (" << std::setprecision(2) << mbsec << " MB/sec)" << partialNote() << std::endl;
+        printCpuCost(cpu, written/BUFSZ, written);
+        lat.print();
+        perf.print(written/BUFSZ);
+
+        std::string name = pass == WritePass::OverwriteSeq ? "overwrite-seq"
+                           : pass == WritePass::OverwriteRandom ? "overwrite-random"
+                           : pass == WritePass::AfterDiscard ? "write-after-discard" : "write";
+        if (fresh && p.prealloc != Prealloc::Extend)
+            name += std::string(" (") + preallocName(p.prealloc) + ")";
+        const PhaseResult r = logResult(p, name, elapsed, written, cpu, lat, progress);
+        if (result)
+            *result = r;
+
+        return interrupted ? 99 : 0;
+    }
+
+    int doDiscard(const Context & p)
+    {
+        const size_t N = p.mb * MB, chunk = p.discardChunkMB * MB;
+
+        int fd = ::open(p.outfile.c_str(), O_WRONLY | O_CLOEXEC);
+        if (fd < 0) {
+            std::cerr << "Error opening file" << std::endl;
+            return 10;
+        }
+
+        Defer defer_CloseFd([&fd]{
+            if (fd >= 0) {
+                ::close(fd);
+                fd = -1;
+            }
+        });
+
+        // Block devices get a real discard (TRIM/UNMAP) where the platform offers one; files get their blocks
+        // deallocated by punching holes, which filesystems pass down to the device as discards.
+        struct stat st;
+        const bool isDevice = ::fstat(fd, &st) == 0 && S_ISBLK(st.st_mode);
+        auto discard = [&](off_t off, off_t len) -> int {
+#ifdef __linux__
+            if (isDevice) {
+                std::uint64_t range[2] = { std::uint64_t(off), std::uint64_t(len) };
+                return ::ioctl(fd, BLKDISCARD, &range);
+            }
+            return ::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len);
+#elif defined(F_PUNCHHOLE)
+            if (isDevice) {
+                errno = ENOTSUP;
+                return -1;
+            }
+            fpunchhole_t ph = { 0, 0, off, len };
+            return ::fcntl(fd, F_PUNCHHOLE, &ph);
+#else
+            (void)off; (void)len;
+            errno = ENOTSUP;
+            return -1;
+#endif
+        };
+
+        out() << "Discarding " << p.mb << " MB of " << p.outfile << " in " << p.discardChunkMB << " MB chunks ("
+              << (isDevice ? "device discard" : "punch hole") << ")..." << std::flush;
+
+        LatencyHistogram lat;
+        PerfCounters perf(p.counters);
+        const CpuUsage cpu0 = CpuUsage::now();
+        perf.start();
+        ProgressReporter progress(p.progressInterval, N);
+        progress.start();
+        const double t0 = getTime();
+        size_t discarded = 0;
+
+        for (size_t off = 0; off < N && !interrupted; off += chunk) {
+            const double tio = getTime();
+            const size_t len = std::min(chunk, N - off);
+            if (discard(off_t(off), off_t(len))) {
+                std::cerr << "\nDiscard failed (" << std::strerror(errno) << ")" << std::endl;
+                return 50;
+            }
+            lat.add(netLatency(getTime() - tio));
+            discarded += len;
+            progress.add(len);
+        }
+        if (!interrupted)
+            fullSync(fd);
+        perf.stop();
+        progress.stop();
+        if (!discarded)
+            return 99;
+
+        const double elapsed = getTime() - t0;
+        const CpuUsage cpu = CpuUsage::now() - cpu0;
+        out() << "took " << std::fixed << std::setprecision(3) << elapsed << " seconds (" << std::setprecision(2)
+              << (discarded / double(MB) / elapsed) << " MB/sec)" << partialNote() << std::endl;
+        printCpuCost(cpu, lat.count(), discarded);
+        lat.print();
+        perf.print(lat.count());
+        logResult(p, "discard", elapsed, discarded, cpu, lat, progress);
+
+        return interrupted ? 99 : 0;
+    }
+
+    bool extentLayout(const std::string & path, ExtentLayout & layout)
+    {
+        layout = ExtentLayout();
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+        Defer defer_CloseFd([fd]{ ::close(fd); });
+
+        std::uint64_t prevEnd = 0;
+        auto add = [&](std::uint64_t physical, std::uint64_t length) {
+            if (!layout.extents++ || physical != prevEnd)
+                ++layout.runs;
+            layout.bytes += length;
+            prevEnd = physical + length;
+        };
+
+#ifdef __linux__
+        // FIEMAP_FLAG_SYNC flushes delayed allocations first, so buffered writes have their final location too
+        constexpr size_t BATCH = 256;
+        std::vector<std::uint64_t> mem((sizeof(struct fiemap) + BATCH * sizeof(struct fiemap_extent) + 7) / 8);
+        struct fiemap *fm = reinterpret_cast<struct fiemap *>(mem.data());
+        for (std::uint64_t start = 0; ; ) {
+            std::fill(mem.begin(), mem.end(), 0);
+            fm->fm_start = start;
+            fm->fm_length = FIEMAP_MAX_OFFSET - start;
+            fm->fm_flags = FIEMAP_FLAG_SYNC;
+            fm->fm_extent_count = BATCH;
+            if (::ioctl(fd, FS_IOC_FIEMAP, fm))
+                return false;
+            bool last = !fm->fm_mapped_extents;
+            for (unsigned i = 0; i < fm->fm_mapped_extents; ++i) {
+                const struct fiemap_extent & e = fm->fm_extents[i];
+                add(e.fe_physical, e.fe_length);
+                start = e.fe_logical + e.fe_length;
+                last = last || (e.fe_flags & FIEMAP_EXTENT_LAST);
+            }
+            if (last)
+                return true;
+        }
+#elif defined(F_LOG2PHYS_EXT)
+        // each call maps as much as is contiguous on the device from the given file offset
+        struct stat st;
+        if (::fstat(fd, &st))
+            return false;
+        for (off_t off = 0; off < st.st_size; ) {
+            struct log2phys l2p = {};
+            l2p.l2p_contigbytes = st.st_size - off;
+            l2p.l2p_devoffset = off;
+            if (::fcntl(fd, F_LOG2PHYS_EXT, &l2p) < 0)
+                return false;
+            if (l2p.l2p_contigbytes <= 0) {
+                errno = EIO;
+                return false;
+            }
+            add(std::uint64_t(l2p.l2p_devoffset), std::uint64_t(l2p.l2p_contigbytes));
+            off += l2p.l2p_contigbytes;
+        }
+        return true;
+#else
+        errno = ENOTSUP;
+        return false;
+#endif
+    }
+
+    int doReplay(const Context & p)
+    {
+        std::vector<TraceRecord> recs;
+        try {
+            recs = loadTrace(p.replayFile);
+        } catch (const std::exception & e) {
+            std::cerr << "Error loading trace " << p.replayFile << " (" << e.what() << ")" << std::endl;
+            return 30;
+        }
+        if (recs.empty()) {
+            std::cerr << "Trace " << p.replayFile << " contains no I/O" << std::endl;
+            return 30;
+        }
+
+        int res = purgeReadCache(p);
+        if (res)
+            return res;
+
+        int fd = ::open(p.outfile.c_str(), O_RDWR | O_CLOEXEC);
+        if (fd < 0) {
+            std::cerr << "Error opening file" << std::endl;
+            return 10;
+        }
+
+        Defer defer_CloseFd([&fd]{
+            if (fd >= 0) {
+                ::close(fd);
+                fd = -1;
+            }
+        });
+
+        if (setNoCache(fd)) {
+            std::cerr << "Failed to disable caching" << std::endl;
+            return 11;
+        }
+
+        const std::uint64_t fileSize = testRegion(p, fd);
+        if (fileSize < 4096) {
+            std::cerr << "Error reading!" << std::endl;
+            return 20;
+        }
+
+        // Traces come from other files and devices, so fit each I/O into the test file: offsets wrap around its size,
+        // and offsets and lengths are rounded to the 4 KB granularity that uncached (direct) I/O requires.
+        constexpr std::uint64_t ALIGN = 4096;
+        std::uint64_t maxLen = ALIGN;
+        for (auto & r : recs) {
+            r.length = std::min(std::max((r.length + ALIGN - 1) / ALIGN * ALIGN, ALIGN), fileSize / ALIGN * ALIGN);
+            r.offset = r.offset / ALIGN * ALIGN % (fileSize - r.length + 1) / ALIGN * ALIGN;
+            maxLen = std::max(maxLen, r.length);
+        }
+        const double tsBase = std::min_element(recs.begin(), recs.end(), [](auto & a, auto & b){ return a.ts < b.ts; })->ts;
+
+        // one worker per trace thread id, each issuing its own I/Os in trace order
+        std::vector<std::uint32_t> tids;
+        for (const auto & r : recs)
+            if (std::find(tids.begin(), tids.end(), r.thread) == tids.end())
+                tids.push_back(r.thread);
+
+        struct Worker {
+            std::vector<const TraceRecord *> recs;
+            LatencyHistogram rlat, wlat;
+            std::uint64_t rBytes = 0, wBytes = 0;
+            bool failed = false;
+        };
+        std::vector<Worker> workers(tids.size());
+        for (const auto & r : recs)
+            workers[std::find(tids.begin(), tids.end(), r.thread) - tids.begin()].recs.push_back(&r);
+
+        out() << "Replaying " << recs.size() << " I/Os from " << p.replayFile << " on " << p.outfile << " ("
+              << workers.size() << (workers.size() == 1 ? " thread, " : " threads, ")
+              << (p.faithful ? "timing-faithful" : "as fast as possible") << ")..." << std::flush;
+
+        std::uint64_t totalBytes = 0;
+        for (const auto & r : recs)
+            totalBytes += r.length;
+
+        PerfCounters perf(p.counters);
+        const CpuUsage cpu0 = CpuUsage::now();
+        perf.start();
+        ProgressReporter progress(p.progressInterval, totalBytes);
+        progress.start();
+        const double t0 = getTime();
+
+        auto run = [&](Worker & w) {
+            auto buf = allocBuffer(maxLen);
+            FastRng rng(std::uint64_t(t0 * 1e9) ^ std::uint64_t(&w - workers.data()));
+            std::uint64_t *words = reinterpret_cast<std::uint64_t *>(buf.get());
+            for (size_t i = 0; i < maxLen / sizeof(*words); ++i)
+                words[i] = rng.next();
+
+            for (const TraceRecord *r : w.recs) {
+                if (interrupted)
+                    return;
+                if (p.faithful) {
+                    // sleep in short slices so an interrupt stops the replay promptly even across long trace gaps
+                    double delay;
+                    while ((delay = t0 + (r->ts - tsBase) - getTime()) > 0. && !interrupted)
+                        std::this_thread::sleep_for(std::chrono::duration<double>(std::min(delay, 0.05)));
+                    if (interrupted)
+                        return;
+                }
+                const struct iovec iov = { buf.get(), size_t(r->length) };
+                const double tio = getTime();
+                const bool isWrite = r->op == 'W';
+                const ssize_t n = isWrite ? writeBlock(p, fd, &iov, 1, off_t(r->offset))
+                                          : readBlock(p, fd, &iov, 1, off_t(r->offset));
+                if (n <= 0) {
+                    w.failed = true;
+                    return;
+                }
+                (isWrite ? w.wlat : w.rlat).add(netLatency(getTime() - tio));
+                (isWrite ? w.wBytes : w.rBytes) += std::uint64_t(n);
+                progress.add(std::uint64_t(n));
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (auto & w : workers)
+            threads.emplace_back(run, std::ref(w));
+        for (auto & t : threads)
+            t.join();
+        if (!interrupted && std::any_of(workers.begin(), workers.end(), [](auto & w){ return w.wBytes; }))
+            fullSync(fd); // writes count once they are on the device, as in doWrite()
+        perf.stop();
+        progress.stop();
+
+        if (std::any_of(workers.begin(), workers.end(), [](auto & w){ return w.failed; })) {
+            std::cerr << "Error replaying trace (I/O failure)" << std::endl;
+            return 31;
+        }
+
+        const double elapsed = getTime() - t0;
+        const CpuUsage cpu = CpuUsage::now() - cpu0;
+        LatencyHistogram rlat, wlat;
+        std::uint64_t rBytes = 0, wBytes = 0;
+        for (const auto & w : workers) {
+            rlat.merge(w.rlat);
+            wlat.merge(w.wlat);
+            rBytes += w.rBytes;
+            wBytes += w.wBytes;
+        }
+        const size_t nOps = rlat.count() + wlat.count();
+        if (!nOps)
+            return 99; // interrupted before any I/O completed
+
+        out() << "took " << std::fixed << std::setprecision(3) << elapsed << " secs (" << std::setprecision(2)
+              << ((rBytes + wBytes) / double(MB) / elapsed) << " MB/sec, " << std::setprecision(0)
+              << (nOps / elapsed) << " IOPS)" << partialNote() << std::endl;
+        out() << "    " << rlat.count() << " reads (" << std::setprecision(2) << (rBytes / double(MB)) << " MB), "
+              << wlat.count() << " writes (" << (wBytes / double(MB)) << " MB)" << std::endl;
+        printCpuCost(cpu, nOps, rBytes + wBytes);
+        rlat.print("Read latency");
+        wlat.print("Write latency");
+        perf.print(nOps);
+        LatencyHistogram lat = rlat;
+        lat.merge(wlat);
+        logResult(p, "replay", elapsed, rBytes + wBytes, cpu, lat, progress);
+
+        return interrupted ? 99 : 0;
+    }
+
+    int doMetadata(const Context & p)
+    {
+        constexpr size_t DIR_FILES = 1000; // files per leaf directory
+        constexpr size_t FILE_SIZE = 4096; // bytes written to each small file on create
+        const size_t nThreads = std::min(p.threads, p.metadataFiles);
+        const std::string & root = p.outfile;
+
+        // Layout: ROOT/tT/dD/fN, renamed to ROOT/tT/dD/rN. Each thread owns its own subtree so the numbers reflect
+        // the filesystem rather than contention on a single directory.
+        struct ThreadTree {
+            std::string dir;
+            std::vector<std::string> subdirs, files, renamed;
+        };
+        std::vector<ThreadTree> trees(nThreads);
+        for (size_t t = 0; t < nThreads; ++t) {
+            auto & tree = trees[t];
+            tree.dir = root + "/t" + std::to_string(t);
+            const size_t n = p.metadataFiles / nThreads + (t < p.metadataFiles % nThreads);
+            for (size_t i = 0; i < n; ++i) {
+                if (i % DIR_FILES == 0)
+                    tree.subdirs.push_back(tree.dir + "/d" + std::to_string(i / DIR_FILES));
+                tree.files.push_back(tree.subdirs.back() + "/f" + std::to_string(i));
+                tree.renamed.push_back(tree.subdirs.back() + "/r" + std::to_string(i));
+            }
+        }
+
+        if (::mkdir(root.c_str(), S_IRWXU)) {
+            std::cerr << "Cannot create directory " << root << " (" << std::strerror(errno) << ")" << std::endl;
+            return 40;
+        }
+
+        bool filesRemoved = false;
+        Defer defer_RmTree([&]{
+            for (const auto & tree : trees) {
+                if (!filesRemoved) // stopped part way through: remove whatever is left under either name
+                    for (size_t i = 0; i < tree.files.size(); ++i) {
+                        ::unlink(tree.files[i].c_str());
+                        ::unlink(tree.renamed[i].c_str());
+                    }
+                for (const auto & d : tree.subdirs)
+                    ::rmdir(d.c_str());
+                ::rmdir(tree.dir.c_str());
+            }
+            if (::rmdir(root.c_str()))
+                std::cerr << "Failed to remove directory " << root << std::endl;
+            else
+                std::cerr << "(Removed " << root << ")" << std::endl;
+        });
+
+        for (const auto & tree : trees) {
+            bool ok = !::mkdir(tree.dir.c_str(), S_IRWXU);
+            for (const auto & d : tree.subdirs)
+                ok = ok && !::mkdir(d.c_str(), S_IRWXU);
+            if (!ok) {
+                std::cerr << "Cannot create directory tree under " << root << " (" << std::strerror(errno) << ")" << std::endl;
+                return 40;
+            }
+        }
+
+        std::vector<char> data(FILE_SIZE);
+        FastRng rng(std::uint64_t(getTime() * 1e9));
+        for (auto & c : data)
+            c = char(rng.next());
+
+        out() << "Metadata benchmark: " << p.metadataFiles << " files of " << FILE_SIZE << " bytes under " << root
+              << " (" << nThreads << (nThreads == 1 ? " thread)" : " threads)") << std::endl;
+
+        // runs op(tree, i) for every item of every thread's tree, timing each call; items(tree) gives the item count
+        auto runPhase = [&](const char *name, auto && items, auto && op) -> bool {
+            std::vector<LatencyHistogram> lats(nThreads);
+            std::vector<int> errs(nThreads);
+            const CpuUsage cpu0 = CpuUsage::now();
+            const double t0 = getTime();
+            std::vector<std::thread> threads;
+            for (size_t t = 0; t < nThreads; ++t)
+                threads.emplace_back([&, t]{
+                    const ThreadTree & tree = trees[t];
+                    for (size_t i = 0; i < items(tree) && !interrupted; ++i) {
+                        const double ts = getTime();
+                        if (!op(tree, i)) {
+                            errs[t] = errno ? errno : EIO;
+                            return;
+                        }
+                        lats[t].add(netLatency(getTime() - ts));
+                    }
+                });
+            for (auto & th : threads)
+                th.join();
+            const double elapsed = getTime() - t0;
+            const CpuUsage cpu = CpuUsage::now() - cpu0;
+            for (int err : errs)
+                if (err) {
+                    std::cerr << name << " failed (" << std::strerror(err) << ")" << std::endl;
+                    return false;
+                }
+
+            LatencyHistogram lat;
+            for (const auto & l : lats)
+                lat.merge(l);
+            if (!lat.count())
+                return false; // interrupted before the first op completed
+            out() << "    " << std::left << std::setw(11) << (std::string(name) + ":") << std::right << lat.count()
+                  << " ops in " << std::fixed << std::setprecision(3) << elapsed << " secs (" << std::setprecision(0)
+                  << (lat.count() / elapsed) << " ops/sec)" << partialNote() << std::endl;
+            lat.print();
+            printCpuCost(cpu, lat.count(), 0);
+            logResult(p, std::string("metadata-") + name, elapsed, 0, cpu, lat, ProgressReporter(0., 0));
+            return !interrupted;
+        };
+
+        auto nFiles = [](const ThreadTree & tree) { return tree.files.size(); };
+        auto nDirs = [](const ThreadTree & tree) { return tree.subdirs.size(); };
+
+        const bool ok =
+            runPhase("create", nFiles, [&](const ThreadTree & tree, size_t i) {
+                const int fd = ::open(tree.files[i].c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR);
+                if (fd < 0)
+                    return false;
+                const bool written = ::write(fd, data.data(), data.size()) == ssize_t(data.size());
+                return !::close(fd) && written;
+            })
+            && runPhase("fsync-dir", nDirs, [&](const ThreadTree & tree, size_t i) {
+                const int fd = ::open(tree.subdirs[i].c_str(), O_RDONLY | O_CLOEXEC);
+                if (fd < 0)
+                    return false;
+                const bool synced = !::fsync(fd);
+                ::close(fd);
+                return synced;
+            })
+            && runPhase("open", nFiles, [&](const ThreadTree & tree, size_t i) {
+                const int fd = ::open(tree.files[i].c_str(), O_RDONLY | O_CLOEXEC);
+                return fd >= 0 && !::close(fd);
+            })
+            && runPhase("stat", nFiles, [&](const ThreadTree & tree, size_t i) {
+                struct stat st;
+                return !::stat(tree.files[i].c_str(), &st);
+            })
+            && runPhase("rename", nFiles, [&](const ThreadTree & tree, size_t i) {
+                return !::rename(tree.files[i].c_str(), tree.renamed[i].c_str());
+            })
+            && runPhase("unlink", nFiles, [&](const ThreadTree & tree, size_t i) {
+                return !::unlink(tree.renamed[i].c_str());
+            });
+
+        if (interrupted)
+            return 99;
+        if (!ok)
+            return 41;
+        filesRemoved = true;
+        return 0;
+    }
+
+    int doBuffered(Context & p)
+    {
+        const size_t N = p.mb * MB;
+
+        if (N < BUFSZ) {
+            std::cerr << "Invalid output size specified: " << N << std::endl;
+            return 2;
+        }
+
+        out() << "Buffered mode: figures below include the page cache and are not device throughput" << std::endl;
+
+        int fd = ::open(p.outfile.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        if (fd < 0) {
+            std::cerr << "Error on " << p.outfile << " (cannot open file for writing)" << std::endl;
+            return 3;
+        }
+        p.outfileCreated = true;
+
+        Defer defer_CloseFd([&fd]{
+            if (fd >= 0) {
+                ::close(fd);
+                fd = -1;
+            }
+        });
+
+        auto buf = allocBuffer(BUFSZ);
+        fillRandom(buf.get(), BUFSZ, std::uint64_t(getTime() * 1e9));
+
+        // Dirty and Writeback from /proc/meminfo (Linux), sampled in the background for the peaks reached while the
+        // writes fill the page cache and while it is flushed
+        const std::vector<const char *> memNames = { "Dirty", "Writeback" };
+        std::vector<std::uint64_t> memBase;
+        const bool haveMeminfo = readProcValues("/proc/meminfo", memNames, memBase);
+        std::uint64_t peakDirty = 0, peakWriteback = 0;
+        std::atomic<bool> sampling{haveMeminfo};
+        std::thread sampler([&]{
+            std::vector<std::uint64_t> v;
+            while (sampling) {
+                if (readProcValues("/proc/meminfo", memNames, v)) {
+                    peakDirty = std::max(peakDirty, v[0]);
+                    peakWriteback = std::max(peakWriteback, v[1]);
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            }
+        });
+        auto stopSampler = [&]{
+            sampling = false;
+            if (sampler.joinable())
+                sampler.join();
+        };
+        Defer defer_StopSampler(stopSampler);
+
+        out() << "Buffered write of " << p.mb << " MB to " << p.outfile << "..." << std::flush;
+        LatencyHistogram lat;
+        ProgressReporter progress(p.progressInterval, N);
+        const CpuUsage cpu0 = CpuUsage::now();
+        progress.start();
+        const double t0 = getTime();
+        double tio = t0;
+        size_t written = 0;
+        for (size_t i = 0; i < N/BUFSZ && !interrupted; ++i) {
+            if (::write(fd, buf.get(), BUFSZ) != ssize_t(BUFSZ)) {
+                std::cerr << "\nError on " << p.outfile << " (write failure)" << std::endl;
+                return 3;
+            }
+            const double t = getTime();
+            lat.add(netLatency(t - tio));
+            tio = t;
+            written += BUFSZ;
+            progress.add(BUFSZ);
+        }
+        progress.stop();
+        const double writeSecs = getTime() - t0;
+        const CpuUsage writeCpu = CpuUsage::now() - cpu0;
+        if (!written)
+            return 99;
+        out() << "took " << std::fixed << std::setprecision(3) << writeSecs << " secs (" << std::setprecision(2)
+              << written / double(MB) / writeSecs << " MB/sec into the page cache)" << partialNote() << std::endl;
+        printCpuCost(writeCpu, written/BUFSZ, written);
+        lat.print();
+        logResult(p, "buffered-write", writeSecs, written, writeCpu, lat, progress);
+        if (interrupted)
+            return 99;
+
+        // write-back: the time until the dirty pages have reached the device, on top of the writes
+        out() << "Flushing dirty pages..." << std::flush;
+        const double t1 = getTime();
+        if (fullSync(fd)) {
+            std::cerr << "\nError on " << p.outfile << " (flush failed)" << std::endl;
+            return 3;
+        }
+        const double flushSecs = getTime() - t1;
+        const CpuUsage flushCpu = CpuUsage::now() - cpu0;
+        stopSampler();
+        out() << "took " << std::fixed << std::setprecision(3) << flushSecs << " secs; write-back "
+              << std::setprecision(2) << written / double(MB) / (writeSecs + flushSecs) << " MB/sec including the flush"
+              << std::endl;
+        if (haveMeminfo)
+            out() << "    Page cache: peak Dirty " << peakDirty / 1024 << " MB, Writeback " << peakWriteback / 1024
+                  << " MB (" << memBase[0] / 1024 << " MB and " << memBase[1] / 1024 << " MB before)" << std::endl;
+        logResult(p, "buffered-write+flush", writeSecs + flushSecs, written, flushCpu, lat, ProgressReporter(0., 0));
+
+        // cached read: whatever the writes left in the page cache, read back through it
+        const double resident = residentFraction(fd, written);
+        out() << "Cached read of " << p.outfile;
+        if (resident >= 0.)
+            out() << " (" << std::fixed << std::setprecision(1) << resident * 100. << "% resident)";
+        out() << "..." << std::flush;
+        LatencyHistogram rlat;
+        ProgressReporter rprogress(p.progressInterval, written);
+        const CpuUsage rcpu0 = CpuUsage::now();
+        rprogress.start();
+        const double t2 = getTime();
+        tio = t2;
+        size_t nread = 0;
+        for (ssize_t n; nread < written && !interrupted; nread += size_t(n)) {
+            if ( (n = ::pread(fd, buf.get(), BUFSZ, off_t(nread))) <= 0) {
+                std::cerr << "\nError reading!" << std::endl;
+                return 20;
+            }
+            const double t = getTime();
+            rlat.add(netLatency(t - tio));
+            tio = t;
+            rprogress.add(std::uint64_t(n));
+        }
+        rprogress.stop();
+        const double readSecs = getTime() - t2;
+        const CpuUsage readCpu = CpuUsage::now() - rcpu0;
+        if (!nread)
+            return 99;
+        out() << "took " << std::fixed << std::setprecision(3) << readSecs << " secs (" << std::setprecision(2)
+              << nread / double(MB) / readSecs << " MB/sec)" << partialNote() << std::endl;
+        printCpuCost(readCpu, rlat.count(), nread);
+        rlat.print();
+        logResult(p, "cached-read", readSecs, nread, readCpu, rlat, rprogress);
+
+        return interrupted ? 99 : 0;
+    }
+
+    int doStalls(Context & p)
+    {
+        const size_t N = p.mb * MB;
+        const double interval = p.progressInterval > 0. ? p.progressInterval : 0.5;
+
+        if (N < BUFSZ) {
+            std::cerr << "Invalid output size specified: " << N << std::endl;
+            return 2;
+        }
+
+        int fd = ::open(p.outfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        if (fd < 0) {
+            std::cerr << "Error on " << p.outfile << " (cannot open file for writing)" << std::endl;
+            return 3;
+        }
+        p.outfileCreated = true;
+
+        Defer defer_CloseFd([&fd]{
+            if (fd >= 0) {
+                ::close(fd);
+                fd = -1;
+            }
+        });
+
+        auto buf = allocBuffer(BUFSZ);
+        fillRandom(buf.get(), BUFSZ, std::uint64_t(getTime() * 1e9));
+
+        // Page cache state from /proc/vmstat (Linux), sampled every interval by a background thread. The writer only
+        // records when each write ended and how long it took; the two are matched up once the writes are done.
+        const std::vector<const char *> vmNames = { "nr_dirty", "nr_writeback", "nr_written", "nr_dirty_threshold",
+                                                    "nr_dirty_background_threshold" };
+        struct VmSample { double t; std::vector<std::uint64_t> v; };
+        std::vector<VmSample> vm(1, VmSample{0., {}});
+        const bool haveVmstat = readProcValues("/proc/vmstat", vmNames, vm[0].v);
+        const std::uint64_t page = std::uint64_t(::sysconf(_SC_PAGESIZE));
+
+        out() << "Write-back stall test: streaming " << p.mb << " MB of buffered writes to " << p.outfile
+              << ", stall = a write over " << fmtDuration(p.stallSecs) << std::endl;
+        if (haveVmstat)
+            out() << "    Dirty limit " << vm[0].v[3] * page / MB << " MB, background write-back from "
+                  << vm[0].v[4] * page / MB << " MB" << std::endl;
+        else
+            out() << "    (/proc/vmstat not available: no page cache figures, stalls only)" << std::endl;
+        out() << "Writing..." << std::flush;
+
+        std::mutex mut;
+        std::condition_variable cond;
+        bool stopping = false;
+        const double t0 = getTime();
+        std::thread sampler([&]{
+            std::unique_lock<std::mutex> lock(mut);
+            for (int i = 1; !cond.wait_until(lock, std::chrono::steady_clock::now()
+                                             + std::chrono::duration<double>(t0 + i * interval - getTime()),
+                                             [&stopping]{ return stopping; }); ++i) {
+                VmSample s{getTime() - t0, {}};
+                if (haveVmstat)
+                    readProcValues("/proc/vmstat", vmNames, s.v);
+                vm.push_back(std::move(s));
+            }
+        });
+        auto stopSampler = [&]{
+            {
+                std::lock_guard<std::mutex> lock(mut);
+                stopping = true;
+            }
+            cond.notify_all();
+            if (sampler.joinable())
+                sampler.join();
+        };
+        Defer defer_StopSampler(stopSampler);
+
+        struct Write { double end, lat; };
+        std::vector<Write> writes;
+        writes.reserve(N/BUFSZ);
+        LatencyHistogram lat;
+        const CpuUsage cpu0 = CpuUsage::now();
+        double tio = getTime();
+        for (size_t i = 0; i < N/BUFSZ && !interrupted; ++i) {
+            if (::write(fd, buf.get(), BUFSZ) != ssize_t(BUFSZ)) {
+                std::cerr << "\nError on " << p.outfile << " (write failure)" << std::endl;
+                return 3;
+            }
+            const double t = getTime();
+            writes.push_back({t - t0, netLatency(t - tio)});
+            lat.add(writes.back().lat);
+            tio = t;
+        }
+        const double elapsed = getTime() - t0;
+        const CpuUsage cpu = CpuUsage::now() - cpu0;
+        stopSampler();
+        if (writes.empty())
+            return 99;
+        vm.push_back({elapsed, {}});
+        if (haveVmstat)
+            readProcValues("/proc/vmstat", vmNames, vm.back().v);
+
+        const size_t written = writes.size() * BUFSZ;
+        out() << "took " << std::fixed << std::setprecision(3) << elapsed << " secs (" << std::setprecision(2)
+              << written / double(MB) / elapsed << " MB/sec)" << partialNote() << std::endl;
+        printCpuCost(cpu, writes.size(), written);
+        lat.print();
+
+        // one row per interval; a stall counts as throttled when the interval saw dirty plus write-back pages past the
+        // midpoint between the background and the dirty limit, where balance_dirty_pages() starts pausing writers
+        std::vector<WritebackSample> rows;
+        size_t w = 0, nStalls = 0, nThrottled = 0;
+        double stallTime = 0., longest = 0.;
+        for (size_t i = 1; i < vm.size(); ++i) {
+            WritebackSample r{vm[i].t, 0, 0., 0, 0, 0, 0, 0};
+            for ( ; w < writes.size() && (writes[w].end <= vm[i].t || i + 1 == vm.size()); ++w) {
+                r.bytes += BUFSZ;
+                r.maxLatency = std::max(r.maxLatency, writes[w].lat);
+                if (writes[w].lat > p.stallSecs) {
+                    ++r.stalls;
+                    stallTime += writes[w].lat;
+                    longest = std::max(longest, writes[w].lat);
+                }
+            }
+            bool throttling = false;
+            if (haveVmstat) {
+                const auto & a = vm[i - 1].v, & b = vm[i].v;
+                r.dirty = b[0] * page;
+                r.writeback = b[1] * page;
+                r.flushed = (b[2] - std::min(a[2], b[2])) * page;
+                r.threshold = b[3] * page;
+                const std::uint64_t freerun = (b[3] + b[4]) / 2;
+                throttling = std::max(a[0] + a[1], b[0] + b[1]) >= freerun;
+            }
+            nStalls += r.stalls;
+            if (throttling)
+                nThrottled += r.stalls;
+            rows.push_back(r);
+        }
+
+        out() << "    " << std::setw(8) << "time" << std::setw(10) << "MB/sec" << std::setw(10) << "dirty MB"
+              << std::setw(14) << "writeback MB" << std::setw(12) << "flushed MB" << std::setw(11) << "max write"
+              << std::endl;
+        double prevT = 0.;
+        for (const WritebackSample & r : rows) {
+            const double dt = r.t - prevT;
+            prevT = r.t;
+            out() << "    " << std::setw(7) << std::fixed << std::setprecision(1) << r.t << "s" << std::setprecision(2)
+                  << std::setw(10) << (dt > 0. ? r.bytes / double(MB) / dt : 0.);
+            if (haveVmstat)
+                out() << std::setw(10) << r.dirty / MB << std::setw(14) << r.writeback / MB << std::setw(12)
+                      << r.flushed / MB;
+            else
+                out() << std::setw(10) << "-" << std::setw(14) << "-" << std::setw(12) << "-";
+            out() << std::setw(11) << (r.bytes ? fmtDuration(r.maxLatency) : "-");
+            if (r.stalls)
+                out() << "  STALL x" << r.stalls;
+            out() << std::endl;
+        }
+        out() << "    Stalls: " << nStalls << " writes over " << fmtDuration(p.stallSecs);
+        if (nStalls) {
+            out() << ", longest " << fmtDuration(longest) << ", " << fmtDuration(stallTime) << " in total";
+            if (haveVmstat)
+                out() << ", " << nThrottled << " while dirty pages were in the throttling range";
+        }
+        out() << std::endl;
+
+        PhaseResult r = makeResult("writeback-stalls", elapsed, written, cpu, lat, ProgressReporter(0., 0));
+        r.writeback = std::move(rows);
+        if (p.results)
+            p.results->add(r);
+
+        return interrupted ? 99 : 0;
+    }
+
+    int doAppendLog(Context & p)
+    {
+        const size_t recSize = p.appendRecord, segSize = p.segmentMB * MB;
+        const size_t nRecords = p.mb * MB / recSize, nThreads = std::min(p.threads, nRecords);
+
+        if (!nRecords || recSize > segSize) {
+            std::cerr << "Invalid append size: " << recSize << " byte records, " << p.mb << " MB in segments of "
+                      << p.segmentMB << " MB" << std::endl;
+            return 2;
+        }
+
+        // The log is OUTFILE.0, OUTFILE.1... Every append reserves its place in the active segment with a fetch_add.
+        // The append whose reservation first crosses the segment size rolls the log over to a new segment; appends
+        // reserved beyond it wait for the new segment and reserve again there. With O_APPEND the reservation is only
+        // the accounting and the kernel picks the offset; with --reserve it is the offset passed to pwrite().
+        struct Segment
+        {
+            int fd = -1;
+            std::atomic<std::uint64_t> reserved{0};
+        };
+        std::vector<std::unique_ptr<Segment>> segments; // all stay open to the end, appends in flight may use them
+        std::atomic<Segment *> active{nullptr};
+        std::mutex segMut; // guards segments
+        auto segName = [&p](size_t i) { return p.outfile + "." + std::to_string(i); };
+        Defer defer_RmSegments([&]{
+            for (size_t i = 0; i < segments.size(); ++i) {
+                ::close(segments[i]->fd);
+                ::unlink(segName(i).c_str());
+            }
+            if (!segments.empty())
+                std::cerr << "(Removed " << segName(0)
+                          << (segments.size() > 1 ? " to " + segName(segments.size() - 1) : "") << ")" << std::endl;
+        });
+        // creates the next segment and makes it the active one; call with segMut held
+        auto openSegment = [&]() -> bool {
+            auto seg = std::make_unique<Segment>();
+            const int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | (p.appendReserve ? 0 : O_APPEND);
+            seg->fd = ::open(segName(segments.size()).c_str(), flags, S_IRUSR | S_IWUSR);
+            if (seg->fd < 0)
+                return false;
+            segments.push_back(std::move(seg));
+            active = segments.back().get();
+            return true;
+        };
+        if (!openSegment()) {
+            std::cerr << "Error on " << segName(0) << " (cannot open file for writing)" << std::endl;
+            return 3;
+        }
+
+        std::vector<char> rec(recSize);
+        FastRng rng(std::uint64_t(getTime() * 1e9));
+        for (auto & c : rec)
+            c = char(rng.next());
+
+        out() << "Append log: " << nThreads << (nThreads == 1 ? " thread" : " threads") << " appending " << nRecords
+              << " records of " << recSize << " bytes to " << p.outfile << ".N ("
+              << (p.appendReserve ? "fetch_add offsets + pwrite" : "O_APPEND") << "), rolling over every "
+              << p.segmentMB << " MB";
+        if (p.appendSyncSecs > 0.)
+            out() << ", fsync every " << fmtDuration(p.appendSyncSecs);
+        out() << std::endl << "Appending..." << std::flush;
+
+        // --fsync: a background thread syncs the active segment every interval, and once more any segment the log
+        // rolled over from since the previous sync
+        LatencyHistogram syncLat;
+        std::atomic<int> syncErr{0};
+        std::mutex mut;
+        std::condition_variable cond;
+        bool stopping = false;
+        std::thread syncer;
+        auto stopSyncer = [&]{
+            {
+                std::lock_guard<std::mutex> lock(mut);
+                stopping = true;
+            }
+            cond.notify_all();
+            if (syncer.joinable())
+                syncer.join();
+        };
+        Defer defer_StopSyncer(stopSyncer);
+
+        std::vector<LatencyHistogram> lats(nThreads);
+        std::vector<int> errs(nThreads);
+        std::atomic<bool> failed{false};
+        ProgressReporter progress(p.progressInterval, std::uint64_t(nRecords) * recSize);
+        std::atomic<size_t> ready{0};
+        std::atomic<bool> go{false};
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < nThreads; ++t)
+            threads.emplace_back([&, t]{
+                const size_t n = nRecords / nThreads + (t < nRecords % nThreads);
+                auto fail = [&](int err) {
+                    errs[t] = err ? err : EIO;
+                    failed = true;
+                };
+
+                ++ready;
+                while (!go)
+                    std::this_thread::yield();
+                double tio = getTime();
+                for (size_t i = 0; i < n && !interrupted && !failed; ++i) {
+                    Segment *seg;
+                    std::uint64_t off;
+                    for (;;) {
+                        seg = active;
+                        off = seg->reserved.fetch_add(recSize);
+                        if (off + recSize <= segSize)
+                            break;
+                        if (off <= segSize) { // the first append past the end rolls over
+                            std::lock_guard<std::mutex> lock(segMut);
+                            if (!openSegment())
+                                return fail(errno);
+                        } else {
+                            while (active == seg && !failed)
+                                std::this_thread::yield();
+                            if (failed)
+                                return;
+                        }
+                    }
+                    const ssize_t nw = p.appendReserve ? ::pwrite(seg->fd, rec.data(), recSize, off_t(off))
+                                                       : ::write(seg->fd, rec.data(), recSize);
+                    if (nw != ssize_t(recSize))
+                        return fail(nw < 0 ? errno : EIO);
+                    const double now = getTime();
+                    lats[t].add(netLatency(now - tio));
+                    tio = now;
+                    progress.add(recSize);
+                }
+            });
+
+        while (ready < nThreads)
+            std::this_thread::yield();
+        const CpuUsage cpu0 = CpuUsage::now();
+        progress.start();
+        const double t0 = getTime();
+        go = true;
+        if (p.appendSyncSecs > 0.)
+            syncer = std::thread([&]{
+                size_t synced = 0; // segments before this one are already synced for good
+                std::unique_lock<std::mutex> lock(mut);
+                for (int i = 1; !cond.wait_until(lock, std::chrono::steady_clock::now()
+                                                 + std::chrono::duration<double>(t0 + i * p.appendSyncSecs - getTime()),
+                                                 [&stopping]{ return stopping; }); ++i) {
+                    std::vector<int> fds;
+                    {
+                        std::lock_guard<std::mutex> segLock(segMut);
+                        for (size_t s = synced; s < segments.size(); ++s)
+                            fds.push_back(segments[s]->fd);
+                        synced = segments.size() - 1;
+                    }
+                    for (const int fd : fds) {
+                        const double ts = getTime();
+                        if (::fsync(fd))
+                            syncErr = errno;
+                        syncLat.add(netLatency(getTime() - ts));
+                    }
+                }
+            });
+        for (auto & th : threads)
+            th.join();
+        const double elapsed = getTime() - t0;
+        const CpuUsage cpu = CpuUsage::now() - cpu0;
+        stopSyncer();
+        progress.stop();
+        for (const int err : errs)
+            if (err) {
+                std::cerr << "\nError on " << p.outfile << ".N (" << std::strerror(err) << ")" << std::endl;
+                return 3;
+            }
+        if (syncErr) {
+            std::cerr << "\nError on " << p.outfile << ".N (fsync: " << std::strerror(syncErr) << ")" << std::endl;
+            return 3;
+        }
+
+        LatencyHistogram lat;
+        for (const auto & l : lats)
+            lat.merge(l);
+        if (!lat.count())
+            return 99;
+        const std::uint64_t written = std::uint64_t(lat.count()) * recSize;
+        out() << "took " << std::fixed << std::setprecision(3) << elapsed << " secs (" << std::setprecision(2)
+              << written / double(MB) / elapsed << " MB/sec, " << std::setprecision(0) << lat.count() / elapsed
+              << " appends/sec)" << partialNote() << std::endl;
+        printCpuCost(cpu, lat.count(), written);
+        lat.print("Append latency");
+        out() << "    Segments: " << segments.size() << " (" << segments.size() - 1 << " rollovers)" << std::endl;
+        logResult(p, "append", elapsed, written, cpu, lat, progress);
+        if (syncLat.count()) {
+            out() << "    Periodic fsyncs: " << syncLat.count() << std::endl;
+            syncLat.print("fsync latency");
+            logResult(p, "append-fsync", elapsed, 0, CpuUsage(), syncLat, ProgressReporter(0., 0));
+        }
+        if (interrupted)
+            return 99;
+
+        // what was appended is only durable once the last segments are synced
+        out() << "Syncing segments..." << std::flush;
+        const double t1 = getTime();
+        for (size_t i = 0; i < segments.size(); ++i)
+            if (fullSync(segments[i]->fd)) {
+                std::cerr << "\nError on " << segName(i) << " (sync: " << std::strerror(errno) << ")" << std::endl;
+                return 3;
+            }
+        const double syncSecs = getTime() - t1;
+        out() << "took " << std::fixed << std::setprecision(3) << syncSecs << " secs (" << std::setprecision(2)
+              << written / double(MB) / (elapsed + syncSecs) << " MB/sec durable)" << std::endl;
+
+        return 0;
+    }
+
+    int doTail(Context & p)
+    {
+        const size_t N = p.mb * MB, nBlocks = N / BUFSZ, nReaders = p.threads;
+        constexpr size_t SECTOR = 512; // each sector of a block starts with a stamp of the run, block and sector
+
+        if (N < BUFSZ) {
+            std::cerr << "Invalid output size specified: " << N << std::endl;
+            return 2;
+        }
+
+        int wfd = ::open(p.outfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        if (wfd < 0) {
+            std::cerr << "Error on " << p.outfile << " (cannot open file for writing)" << std::endl;
+            return 3;
+        }
+        p.outfileCreated = true;
+        int rfd = ::open(p.outfile.c_str(), O_RDONLY | O_CLOEXEC);
+        Defer defer_CloseFds([&wfd, &rfd]{
+            ::close(wfd);
+            if (rfd >= 0)
+                ::close(rfd);
+        });
+        if (rfd < 0) {
+            std::cerr << "Error opening file" << std::endl;
+            return 10;
+        }
+        if (setNoCache(wfd) || setNoCache(rfd)) {
+            std::cerr << "Error on " << p.outfile << " (failed to disable caching)" << std::endl;
+            return 11;
+        }
+
+        const std::uint64_t nonce = FastRng(std::uint64_t(getTime() * 1e9)).next();
+        // Blocks hold the same random payload, generated from the nonce, with each sector's first 8 bytes overwritten
+        // by its stamp. Readers build the expected block the same way and compare all of it, so a short read, stale
+        // data or a torn block with any sector missing is caught.
+        auto fillPayload = [nonce](char *b) { fillRandom(b, BUFSZ, nonce); };
+        auto stampBlock = [nonce](char *b, size_t block) {
+            for (size_t sec = 0; sec < BUFSZ / SECTOR; ++sec) {
+                const std::uint64_t v = nonce ^ ((std::uint64_t(block) << 16) | sec);
+                std::memcpy(b + sec * SECTOR, &v, sizeof(v));
+            }
+        };
+
+        // The writer publishes each block once its write has returned: pubTime[i] first, then published = i + 1.
+        // Every reader follows the tail, reading each block as soon as it is published and checking that all of it
+        // is there, the way a replication follower tails a log.
+        std::vector<double> pubTime(nBlocks);
+        std::atomic<size_t> published{0};
+        std::atomic<bool> writerDone{false};
+        LatencyHistogram wlat;
+        int werr = 0;
+        std::vector<LatencyHistogram> rawLats(nReaders), readLats(nReaders);
+        std::vector<size_t> mismatches(nReaders), maxLag(nReaders);
+        std::vector<int> rerrs(nReaders);
+
+        out() << "Read-after-write probe: 1 writer appending " << p.mb << " MB to " << p.outfile << ", " << nReaders
+              << (nReaders == 1 ? " reader" : " readers") << " following the tail..." << std::flush;
+
+        std::atomic<size_t> ready{0};
+        std::atomic<bool> go{false};
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < nReaders; ++t)
+            threads.emplace_back([&, t]{
+                auto buf = allocBuffer(BUFSZ), expect = allocBuffer(BUFSZ);
+                fillPayload(expect.get());
+                ++ready;
+                while (!go)
+                    std::this_thread::yield();
+                for (size_t i = 0; i < nBlocks && !interrupted; ++i) {
+                    size_t avail;
+                    while ((avail = published.load(std::memory_order_acquire)) <= i && !writerDone && !interrupted)
+                        std::this_thread::yield();
+                    if (avail <= i && (avail = published.load(std::memory_order_acquire)) <= i)
+                        break; // the writer stopped short
+                    maxLag[t] = std::max(maxLag[t], avail - 1 - i);
+                    const double ts = getTime();
+                    const ssize_t n = ::pread(rfd, buf.get(), BUFSZ, off_t(i * BUFSZ));
+                    if (n < 0) {
+                        rerrs[t] = errno;
+                        return;
+                    }
+                    const double now = getTime();
+                    readLats[t].add(netLatency(now - ts));
+                    rawLats[t].add(netLatency(now - pubTime[i]));
+                    stampBlock(expect.get(), i);
+                    mismatches[t] += n != ssize_t(BUFSZ) || std::memcmp(buf.get(), expect.get(), BUFSZ) != 0;
+                }
+            });
+
+        while (ready < nReaders)
+            std::this_thread::yield();
+        auto buf = allocBuffer(BUFSZ);
+        fillPayload(buf.get());
+        const CpuUsage cpu0 = CpuUsage::now();
+        const double t0 = getTime();
+        go = true;
+        for (size_t i = 0; i < nBlocks && !interrupted; ++i) {
+            stampBlock(buf.get(), i);
+            const double ts = getTime();
+            if (::write(wfd, buf.get(), BUFSZ) != ssize_t(BUFSZ)) {
+                werr = errno ? errno : EIO;
+                break;
+            }
+            const double now = getTime();
+            wlat.add(netLatency(now - ts));
+            pubTime[i] = now;
+            published.store(i + 1, std::memory_order_release);
+        }
+        writerDone = true;
+        for (auto & th : threads)
+            th.join();
+        const double elapsed = getTime() - t0;
+        const CpuUsage cpu = CpuUsage::now() - cpu0;
+
+        if (werr) {
+            std::cerr << "\nError on " << p.outfile << " (write failure: " << std::strerror(werr) << ")" << std::endl;
+            return 3;
+        }
+        for (const int err : rerrs)
+            if (err) {
+                std::cerr << "\nError on " << p.outfile << " (read failure: " << std::strerror(err) << ")" << std::endl;
+                return 20;
+            }
+
+        LatencyHistogram rawLat, readLat;
+        size_t nMismatched = 0, lag = 0;
+        for (size_t t = 0; t < nReaders; ++t) {
+            rawLat.merge(rawLats[t]);
+            readLat.merge(readLats[t]);
+            nMismatched += mismatches[t];
+            lag = std::max(lag, maxLag[t]);
+        }
+        const size_t written = published * BUFSZ;
+        if (!written)
+            return 99;
+        out() << "took " << std::fixed << std::setprecision(3) << elapsed << " secs (" << std::setprecision(2)
+              << written / double(MB) / elapsed << " MB/sec written, " << readLat.count() * BUFSZ / double(MB) / elapsed
+              << " MB/sec read back)" << partialNote() << std::endl;
+        printCpuCost(cpu, wlat.count() + readLat.count(), written + readLat.count() * BUFSZ);
+        wlat.print("Write latency");
+        readLat.print("Read latency");
+        rawLat.print("Read-after-write latency");
+        out() << "    Visibility: " << readLat.count() - nMismatched << " of " << readLat.count()
+              << " reads saw the complete block";
+        if (nMismatched)
+            out() << ", " << nMismatched << " MISMATCHED (short, stale or torn)";
+        out() << ", readers were up to " << lag << (lag == 1 ? " block" : " blocks") << " behind the writer"
+              << std::endl;
+        logResult(p, "tail-write", elapsed, written, cpu, wlat, ProgressReporter(0., 0));
+        logResult(p, "tail-read", elapsed, readLat.count() * BUFSZ, CpuUsage(), readLat, ProgressReporter(0., 0));
+        logResult(p, "tail-read-after-write", elapsed, readLat.count() * BUFSZ, CpuUsage(), rawLat,
+                  ProgressReporter(0., 0));
+
+        if (nMismatched)
+            return 21;
+        return interrupted ? 99 : 0;
+    }
+
+    int doSyncRangeWrite(Context & p)
+    {
+        const size_t N = p.mb * MB, range = p.syncRangeMB * MB;
+
+        if (N < BUFSZ) {
+            std::cerr << "Invalid output size specified: " << N << std::endl;
+            return 2;
+        }
+
+        int fd = ::open(p.outfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        if (fd < 0) {
+            std::cerr << "Error on " << p.outfile << " (cannot open file for writing)" << std::endl;
+            return 3;
+        }
+        p.outfileCreated = true;
+
+        Defer defer_CloseFd([&fd]{
+            if (fd >= 0) {
+                ::close(fd);
+                fd = -1;
+            }
+        });
+
+        auto buf = allocBuffer(BUFSZ);
+        fillRandom(buf.get(), BUFSZ, std::uint64_t(getTime() * 1e9));
+        IoVecPool pool(p.iovecs, buf.get(), BUFSZ);
+
+        // dirty and write-back pages (/proc/meminfo, Linux), checked at every range boundary before syncing, to show
+        // how little piles up in the page cache
+        const std::vector<const char *> memNames = { "Dirty", "Writeback" };
+        std::vector<std::uint64_t> mem;
+        const bool haveMeminfo = readProcValues("/proc/meminfo", memNames, mem);
+        std::uint64_t peakDirty = 0;
+
+#ifdef SYNC_FILE_RANGE_WRITE
+        const char *how = "sync_file_range";
+#else
+        const char *how = "fsync";
+#endif
+        out() << "Streaming " << p.mb << " MB to " << p.outfile << modeDesc(p) << " with " << how << " every "
+              << p.syncRangeMB << " MB..." << std::flush;
+
+        LatencyHistogram lat;
+        ProgressReporter progress(p.progressInterval, N);
+        const CpuUsage cpu0 = CpuUsage::now();
+        progress.start();
+        const double t0 = getTime();
+        double tio = t0;
+        size_t written = 0;
+        for (size_t i = 0; i < N/BUFSZ && !interrupted; ++i) {
+            if (writeBlock(p, fd, pool.next(), pool.count()) != ssize_t(BUFSZ)) {
+                std::cerr << "\nError on " << p.outfile << " (write failure)" << std::endl;
+                return 3;
+            }
+            written += BUFSZ;
+            if (written % range == 0) {
+                if (haveMeminfo && readProcValues("/proc/meminfo", memNames, mem))
+                    peakDirty = std::max(peakDirty, mem[0] + mem[1]);
+                // Start write-back of the range just completed, then wait for the one before it (started a range
+                // ago, so normally done by now) and drop it from the page cache: write-back streams steadily behind
+                // the writer instead of piling up until dirty_ratio forces a stall.
+                const off_t cur = off_t(written - range);
+                int res;
+#ifdef SYNC_FILE_RANGE_WRITE
+                res = ::sync_file_range(fd, cur, off_t(range), SYNC_FILE_RANGE_WRITE);
+                if (!res && cur >= off_t(range)) {
+                    res = ::sync_file_range(fd, cur - off_t(range), off_t(range), SYNC_FILE_RANGE_WAIT_BEFORE
+                                            | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+                    if (!res)
+                        res = ::posix_fadvise(fd, cur - off_t(range), off_t(range), POSIX_FADV_DONTNEED);
+                }
+#else
+                (void)cur;
+                res = ::fsync(fd);
+#endif
+                if (res) {
+                    std::cerr << "\nError on " << p.outfile << " (" << how << " failed)" << std::endl;
+                    return 3;
+                }
+            }
+            const double t = getTime();
+            lat.add(netLatency(t - tio));
+            tio = t;
+            progress.add(BUFSZ);
+        }
+        if (!interrupted) // the tail: everything still dirty or in flight
+            fullSync(fd);
+        progress.stop();
+        const double elapsed = getTime() - t0;
+        const CpuUsage cpu = CpuUsage::now() - cpu0;
+        if (!written)
+            return 99;
+#ifdef POSIX_FADV_DONTNEED
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+
+        out() << "took " << std::fixed << std::setprecision(3) << elapsed << " seconds (" << std::setprecision(2)
+              << written / double(MB) / elapsed << " MB/sec)" << partialNote() << std::endl;
+        printCpuCost(cpu, written/BUFSZ, written);
+        lat.print();
+        if (haveMeminfo)
+            out() << "    Page cache: peak Dirty + Writeback " << peakDirty / 1024 << " MB" << std::endl;
+        logResult(p, std::string("write (") + how + " " + std::to_string(p.syncRangeMB) + " MB)", elapsed, written,
+                  cpu, lat, progress);
+
+        return interrupted ? 99 : 0;
+    }
+
+    int doCopy(const Context & p)
+    {
+        const std::string dstPath = p.outfile + ".copy";
+        if (isDevice(p.outfile)) {
+            std::cerr << "Copying needs a regular file, not device " << p.outfile << std::endl;
+            return 50;
+        }
+        struct stat st;
+        if (::stat(p.outfile.c_str(), &st)) {
+            std::cerr << "Error opening file" << std::endl;
+            return 10;
+        }
+        const std::uint64_t size = std::uint64_t(st.st_size);
+
+        // Each method copies the whole file to dstPath through the page cache, BUFSZ per call, and the copy is synced
+        // before the clock stops. Returns the bytes copied, or -1 with errno set (ENOSYS etc. if unsupported).
+        using CopyFn = std::function<std::int64_t(int src, int dst, LatencyHistogram & lat)>;
+        auto timedLoop = [size](LatencyHistogram & lat, auto && step) -> std::int64_t {
+            std::uint64_t done = 0;
+            double tio = getTime();
+            while (done < size && !interrupted) {
+                const ssize_t n = step();
+                if (n < 0)
+                    return -1;
+                if (n == 0)
+                    break;
+                const double t = getTime();
+                lat.add(netLatency(t - tio));
+                tio = t;
+                done += std::uint64_t(n);
+            }
+            return std::int64_t(done);
+        };
+        std::vector<std::pair<const char *, CopyFn>> methods;
+        methods.emplace_back("read+write", [&](int src, int dst, LatencyHistogram & lat) {
+            auto buf = allocBuffer(BUFSZ);
+            return timedLoop(lat, [&]() -> ssize_t {
+                const ssize_t n = ::read(src, buf.get(), BUFSZ);
+                if (n <= 0)
+                    return n;
+                const ssize_t w = ::write(dst, buf.get(), size_t(n));
+                if (w != n && w >= 0)
+                    errno = EIO; // a short write is a failure, not an unsupported call
+                return w == n ? n : -1;
+            });
+        });
+#ifdef __linux__
+        methods.emplace_back("copy_file_range", [&](int src, int dst, LatencyHistogram & lat) {
+            return timedLoop(lat, [&]() -> ssize_t {
+#ifdef SYS_copy_file_range
+                return ::syscall(SYS_copy_file_range, src, nullptr, dst, nullptr, BUFSZ, 0);
+#else
+                errno = ENOSYS;
+                return -1;
+#endif
+            });
+        });
+        methods.emplace_back("sendfile", [&](int src, int dst, LatencyHistogram & lat) {
+            return timedLoop(lat, [&] { return ::sendfile(dst, src, nullptr, BUFSZ); });
+        });
+        methods.emplace_back("splice", [&](int src, int dst, LatencyHistogram & lat) -> std::int64_t {
+            int pfd[2];
+            if (::pipe(pfd))
+                return -1;
+            Defer defer_ClosePipe([&pfd]{
+                ::close(pfd[0]);
+                ::close(pfd[1]);
+            });
+            ::fcntl(pfd[1], F_SETPIPE_SZ, int(BUFSZ)); // best effort, the default pipe holds only 64 KB
+            return timedLoop(lat, [&]() -> ssize_t {
+                const ssize_t n = ::splice(src, nullptr, pfd[1], nullptr, BUFSZ, SPLICE_F_MOVE | SPLICE_F_MORE);
+                for (ssize_t left = n; left > 0; ) {
+                    const ssize_t m = ::splice(pfd[0], nullptr, dst, nullptr, size_t(left), SPLICE_F_MOVE | SPLICE_F_MORE);
+                    if (m <= 0) {
+                        if (m == 0)
+                            errno = EIO; // the pipe would not drain: a failure, not an unsupported call
+                        return -1;
+                    }
+                    left -= m;
+                }
+                return n;
+            });
+        });
+#elif defined(__APPLE__)
+        methods.emplace_back("fcopyfile", [&](int src, int dst, LatencyHistogram & lat) -> std::int64_t {
+            // a single call copies the whole file, so the latency histogram holds just that one sample
+            return timedLoop(lat, [&]() -> ssize_t {
+                return ::fcopyfile(src, dst, nullptr, COPYFILE_DATA) ? -1 : ssize_t(size);
+            });
+        });
+#endif
+
+        struct Row { const char *name; double mbPerSec, msPerGB; };
+        std::vector<Row> rows;
+        for (const auto & m : methods) {
+            int res = purgeReadCache(p);
+            if (res)
+                return res;
+            int src = ::open(p.outfile.c_str(), O_RDONLY | O_CLOEXEC);
+            int dst = ::open(dstPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+            Defer defer_Close([&]{
+                if (src >= 0)
+                    ::close(src);
+                if (dst >= 0) {
+                    ::close(dst);
+                    ::unlink(dstPath.c_str());
+                }
+            });
+            if (src < 0 || dst < 0) {
+                std::cerr << "Cannot open " << (src < 0 ? p.outfile : dstPath) << " (" << std::strerror(errno) << ")"
+                          << std::endl;
+                return 50;
+            }
+
+            out() << "Copying " << size / MB << " MB to " << dstPath << " with " << m.first << "..." << std::flush;
+            LatencyHistogram lat;
+            const CpuUsage cpu0 = CpuUsage::now();
+            const double t0 = getTime();
+            const std::int64_t copied = m.second(src, dst, lat);
+            if (copied < 0) {
+                const int err = errno;
+                if (err == ENOSYS || err == EINVAL || err == EXDEV || err == EOPNOTSUPP) {
+                    out() << "not supported here (" << std::strerror(err) << ")" << std::endl;
+                    continue;
+                }
+                std::cerr << "\nCopy failed (" << std::strerror(err) << ")" << std::endl;
+                return 51;
+            }
+            if (!interrupted && fullSync(dst)) {
+                std::cerr << "\nError syncing " << dstPath << std::endl;
+                return 51;
+            }
+            const double elapsed = getTime() - t0;
+            const CpuUsage cpu = CpuUsage::now() - cpu0;
+            if (!copied) {
+                if (interrupted)
+                    return 99;
+                std::cerr << "\nCopy failed (nothing copied from " << p.outfile << ")" << std::endl;
+                return 51;
+            }
+
+            out() << "took " << std::fixed << std::setprecision(3) << elapsed << " secs (" << std::setprecision(2)
+                  << copied / double(MB) / elapsed << " MB/sec)" << partialNote() << std::endl;
+            printCpuCost(cpu, lat.count(), std::uint64_t(copied));
+            const PhaseResult r = logResult(p, std::string("copy ") + m.first, elapsed, std::uint64_t(copied), cpu, lat,
+                                            ProgressReporter(0., 0));
+            rows.push_back({m.first, r.mbPerSec, (cpu.user + cpu.sys) * 1e3 / (copied / (1024. * MB))});
+            if (interrupted)
+                return 99;
+        }
+
+        out() << "Copy throughput by method:" << std::endl;
+        for (const Row & r : rows)
+            out() << "    " << std::left << std::setw(16) << r.name << std::right << std::fixed << std::setprecision(2)
+                  << std::setw(10) << r.mbPerSec << " MB/sec" << std::setw(10) << r.msPerGB << " CPU ms/GB" << std::endl;
+        return 0;
+    }
+
+    int doMemBandwidth(const Context & p)
+    {
+        constexpr size_t SPAN = 64 * MB; // memory each thread streams through, well beyond the caches
+        constexpr double TEST_SECS = 0.5;
+        const size_t nThreads = p.threads;
+        enum Kind { Memcpy, Memset, Triad };
+        const char *names[] = { "memcpy", "memset", "triad" };
+
+        out() << "Memory bandwidth baseline (" << nThreads << (nThreads == 1 ? " thread" : " threads") << ", "
+              << SPAN / MB << " MB each):" << std::endl;
+
+        for (const Kind kind : { Memcpy, Memset, Triad }) {
+            std::vector<std::uint64_t> bytes(nThreads);
+            std::atomic<size_t> ready{0};
+            std::atomic<bool> go{false};
+            double deadline = 0.;
+            std::vector<std::thread> threads;
+            for (size_t t = 0; t < nThreads; ++t)
+                threads.emplace_back([&, t]{
+                    // memcpy copies from a large span into the same I/O buffers the read loop uses, as the kernel does
+                    // for a cached read; memset only writes; triad is STREAM's a = b + s * c over three arrays
+                    auto span = allocBuffer(SPAN), buf = allocBuffer(BUFSZ);
+                    std::memset(span.get(), 1, SPAN);
+                    std::memset(buf.get(), 0, BUFSZ);
+                    IoVecPool pool(p.iovecs, buf.get(), BUFSZ);
+                    constexpr size_t TRIAD_N = SPAN / 3 / sizeof(double);
+                    double *a = reinterpret_cast<double *>(span.get()), *b = a + TRIAD_N, *c = b + TRIAD_N;
+                    std::fill(a, a + 3 * TRIAD_N, 1.);
+
+                    ++ready;
+                    while (!go)
+                        std::this_thread::yield();
+                    std::uint64_t n = 0;
+                    while (getTime() < deadline && !interrupted) {
+                        if (kind == Memcpy) {
+                            for (size_t off = 0; off < SPAN; off += BUFSZ) {
+                                const struct iovec *iov = pool.next();
+                                size_t segOff = off;
+                                for (int i = 0; i < pool.count(); segOff += iov[i++].iov_len)
+                                    std::memcpy(iov[i].iov_base, span.get() + segOff, iov[i].iov_len);
+                            }
+                            n += SPAN;
+                        } else if (kind == Memset) {
+                            for (size_t off = 0; off < SPAN; off += BUFSZ)
+                                std::memset(span.get() + off, int(off / BUFSZ), BUFSZ);
+                            n += SPAN;
+                        } else {
+                            for (size_t i = 0; i < TRIAD_N; ++i)
+                                a[i] = b[i] + 3. * c[i];
+                            n += 3 * TRIAD_N * sizeof(double);
+                        }
+                        asm volatile("" : : "r"(span.get()), "r"(buf.get()) : "memory"); // keep the work observable
+                    }
+                    bytes[t] = n;
+                });
+
+            while (ready < nThreads)
+                std::this_thread::yield();
+            const CpuUsage cpu0 = CpuUsage::now();
+            const double t0 = getTime();
+            deadline = t0 + TEST_SECS;
+            go = true;
+            for (auto & th : threads)
+                th.join();
+            const double elapsed = getTime() - t0;
+            const CpuUsage cpu = CpuUsage::now() - cpu0;
+            std::uint64_t total = 0;
+            for (const auto n : bytes)
+                total += n;
+            if (!total)
+                return 99;
+            out() << "    " << std::left << std::setw(8) << names[kind] << std::right << std::fixed << std::setprecision(2)
+                  << std::setw(10) << total / elapsed / (1024. * MB) << " GB/sec" << partialNote() << std::endl;
+            logResult(p, std::string("membw-") + names[kind], elapsed, total, cpu, LatencyHistogram(),
+                      ProgressReporter(0., 0));
+            if (interrupted)
+                return 99;
+        }
+        return 0;
+    }
+
+    int doScale(const Context & p)
+    {
+        constexpr double STEP_SECS = 2.; // duration of each step
+        int res = purgeReadCache(p);
+        if (res)
+            return res;
+        int fd = ::open(p.outfile.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            std::cerr << "Error opening file" << std::endl;
+            return 10;
+        }
+
+        Defer defer_CloseFd([&fd]{
+            if (fd >= 0) {
+                ::close(fd);
+                fd = -1;
+            }
+        });
+
+        if ( (res = setNoCache(fd)) ) {
+            std::cerr << "setNoCache returned " << res << std::endl;
+            return 11;
+        }
+        const size_t nBlocks = size_t(testRegion(p, fd) / BUFSZ);
+        if (!nBlocks) {
+            std::cerr << "Error reading!" << std::endl;
+            return 20;
+        }
+
+        // concurrent workers read blocks at random (or from the --pattern distribution) so they never queue up
+        // behind each other the way sequential readers would
+        AccessPattern pat = p.pattern;
+        if (pat.kind == AccessPattern::Seq)
+            pat.kind = AccessPattern::Uniform;
+        // built once, so every step and thread shares the same hot blocks and only the samples differ
+        const OffsetGenerator proto(pat, nBlocks, std::uint64_t(getTime() * 1e9));
+
+        out() << "Scaling search on " << p.outfile << " (" << pat.describe() << "), " << std::defaultfloat << STEP_SECS
+              << " secs per step, up to " << p.scaleMax << " threads, stopping below " << p.scaleMinGain << "% gain";
+        if (p.scaleP99Limit > 0.)
+            out() << " or above p99 " << fmtDuration(p.scaleP99Limit);
+        out() << ":" << std::endl;
+        out() << "    " << std::setw(7) << "threads" << std::setw(12) << "MB/sec" << std::setw(10) << "IOPS" << std::setw(11)
+              << "p50" << std::setw(11) << "p99" << std::setw(9) << "gain" << std::endl;
+
+        struct Step
+        {
+            size_t threads;
+            PhaseResult r;
+        };
+        std::vector<Step> steps;
+        const char *stopReason = "reached the thread limit";
+        for (size_t n = 1; !interrupted; n = std::min(n * 2, p.scaleMax)) {
+            std::vector<LatencyHistogram> lats(n);
+            std::vector<std::uint64_t> bytes(n);
+            std::vector<int> errs(n);
+            std::atomic<size_t> ready{0};
+            std::atomic<bool> go{false};
+            double deadline = 0.;
+            std::vector<std::thread> threads;
+            for (size_t t = 0; t < n; ++t)
+                threads.emplace_back([&, t]{
+                    auto buf = allocBuffer(BUFSZ);
+                    IoVecPool pool(p.iovecs, buf.get(), BUFSZ);
+                    OffsetGenerator gen(proto);
+                    gen.reseed(std::uint64_t(getTime() * 1e9) ^ (t << 32));
+                    ++ready;
+                    while (!go)
+                        std::this_thread::yield();
+                    double tio = getTime();
+                    while (tio < deadline && !interrupted) {
+                        const ssize_t nread = readBlock(p, fd, pool.next(), pool.count(), off_t(gen.next() * BUFSZ));
+                        if (nread <= 0) {
+                            errs[t] = nread < 0 ? errno : EIO;
+                            return;
+                        }
+                        const double now = getTime();
+                        lats[t].add(netLatency(now - tio));
+                        tio = now;
+                        bytes[t] += std::uint64_t(nread);
+                    }
+                });
+            // threads and their buffers are set up before the clock starts, so each step times only the reads
+            while (ready < n)
+                std::this_thread::yield();
+            const CpuUsage cpu0 = CpuUsage::now();
+            const double t0 = getTime();
+            deadline = t0 + STEP_SECS;
+            go = true;
+            for (auto & th : threads)
+                th.join();
+            const double elapsed = getTime() - t0;
+            const CpuUsage cpu = CpuUsage::now() - cpu0;
+            for (int err : errs)
+                if (err) {
+                    std::cerr << "Read failed (" << std::strerror(err) << ")" << std::endl;
+                    return 20;
+                }
+
+            LatencyHistogram lat;
+            std::uint64_t total = 0;
+            for (size_t t = 0; t < n; ++t) {
+                lat.merge(lats[t]);
+                total += bytes[t];
+            }
+            if (!total)
+                break;
+            steps.push_back({n, logResult(p, "scale " + std::to_string(n) + " threads", elapsed, total, cpu, lat,
+                                          ProgressReporter(0., 0))});
+            const PhaseResult & r = steps.back().r;
+            const double gain = steps.size() > 1 ? (r.mbPerSec / steps[steps.size() - 2].r.mbPerSec - 1.) * 100. : 0.;
+            out() << "    " << std::setw(7) << n << std::fixed << std::setprecision(2) << std::setw(12) << r.mbPerSec
+                  << std::setprecision(0) << std::setw(10) << r.ops / elapsed << std::setw(11)
+                  << fmtDuration(lat.percentile(50.)) << std::setw(11) << fmtDuration(lat.percentile(99.));
+            std::ostringstream g;
+            if (steps.size() > 1)
+                g << std::showpos << std::fixed << std::setprecision(1) << gain << "%";
+            else
+                g << "-";
+            out() << std::setw(9) << g.str() << partialNote() << std::endl;
+
+            if (p.scaleP99Limit > 0. && lat.percentile(99.) > p.scaleP99Limit) {
+                stopReason = "p99 latency over the limit";
+                break;
+            }
+            if (steps.size() > 1 && gain < p.scaleMinGain) {
+                stopReason = "throughput saturated";
+                break;
+            }
+            if (n >= p.scaleMax)
+                break;
+        }
+
+        // The best throughput of any step within the latency budget, and the knee: the fewest threads getting within
+        // the minimum gain of it, beyond which more parallelism buys little but queueing delay.
+        auto inBudget = [&p](const Step & s) {
+            return p.scaleP99Limit <= 0. || s.r.lat.percentile(99.) <= p.scaleP99Limit;
+        };
+        const Step *best = nullptr, *knee = nullptr;
+        for (const Step & s : steps)
+            if (inBudget(s) && (!best || s.r.mbPerSec > best->r.mbPerSec))
+                best = &s;
+        for (const Step & s : steps)
+            if (!knee && best && inBudget(s) && s.r.mbPerSec >= best->r.mbPerSec * (1. - p.scaleMinGain / 100.))
+                knee = &s;
+        if (interrupted)
+            stopReason = "interrupted";
+        if (knee)
+            out() << "Knee: " << knee->threads << (knee->threads == 1 ? " thread, " : " threads, ") << std::fixed
+                  << std::setprecision(2) << knee->r.mbPerSec << " MB/sec at p99 "
+                  << fmtDuration(knee->r.lat.percentile(99.)) << "; best within budget " << best->r.mbPerSec
+                  << " MB/sec with " << best->threads
+                  << (best->threads == 1 ? " thread" : " threads") << " (stopped: " << stopReason << ")" << std::endl;
+        else if (!steps.empty())
+            out() << "Knee: none, even 1 thread exceeds the p99 limit" << std::endl;
+
+        return interrupted ? 99 : 0;
+    }
+
+    int doTargets(const Context & p)
+    {
+        const size_t N = p.mb * MB;
+
+        if (N < BUFSZ) {
+            std::cerr << "Invalid output size specified: " << N << std::endl;
+            return 2;
+        }
+
+        std::vector<std::string> paths{p.outfile};
+        paths.insert(paths.end(), p.targets.begin(), p.targets.end());
+        const size_t nTargets = paths.size();
+        if (std::set<std::string>(paths.begin(), paths.end()).size() != nTargets) {
+            std::cerr << "Targets must be distinct files" << std::endl;
+            return 2;
+        }
+
+        // every target stays open for both passes; files are created for the run and removed at the end, while
+        // devices are written in place and left alone
+        std::vector<int> fds(nTargets, -1);
+        std::vector<bool> created(nTargets);
+        Defer defer_RmTargets([&]{
+            for (size_t t = 0; t < nTargets; ++t) {
+                if (fds[t] < 0)
+                    continue;
+                ::close(fds[t]);
+                if (!created[t])
+                    continue;
+                if (::unlink(paths[t].c_str()))
+                    std::cerr << "Failed to remove file " << paths[t] << std::endl;
+                else
+                    std::cerr << "(Removed " << paths[t] << ")" << std::endl;
+            }
+        });
+        for (size_t t = 0; t < nTargets; ++t) {
+            created[t] = !isDevice(paths[t]);
+            fds[t] = created[t] ? ::open(paths[t].c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR)
+                                : ::open(paths[t].c_str(), O_RDWR | O_CLOEXEC);
+            if (fds[t] < 0 || setNoCache(fds[t])) {
+                std::cerr << "Error on " << paths[t] << " (cannot open file for uncached I/O)" << std::endl;
+                return 3;
+            }
+        }
+
+        // Runs a pass over all targets at once, one worker each. Workers set up their buffers first and start
+        // together, so the aggregate covers only the time all of them had I/O in flight, plus the stragglers.
+        auto runPass = [&](bool isWrite) -> int {
+            struct Worker
+            {
+                LatencyHistogram lat;
+                std::uint64_t bytes = 0;
+                double secs = 0.;
+                int err = 0;
+            };
+            std::vector<Worker> workers(nTargets);
+            ProgressReporter progress(p.progressInterval, std::uint64_t(N) * nTargets);
+            std::atomic<size_t> ready{0};
+            std::atomic<bool> go{false};
+
+            out() << (isWrite ? "Writing " : "Reading back ") << p.mb << " MB " << (isWrite ? "to" : "of") << " each of "
+                  << nTargets << " targets concurrently" << modeDesc(p, !isWrite) << "..." << std::flush;
+
+            std::vector<std::thread> threads;
+            for (size_t t = 0; t < nTargets; ++t)
+                threads.emplace_back([&, t]{
+                    Worker & w = workers[t];
+                    auto buf = allocBuffer(BUFSZ);
+                    FastRng rng(std::uint64_t(getTime() * 1e9) ^ t);
+                    fillRandom(buf.get(), BUFSZ, rng.next());
+                    IoVecPool pool(p.iovecs, buf.get(), BUFSZ);
+                    std::unique_ptr<OffsetGenerator> gen;
+                    if (!isWrite && p.pattern.kind != AccessPattern::Seq)
+                        gen = std::make_unique<OffsetGenerator>(p.pattern, N / BUFSZ, rng.next());
+
+                    ++ready;
+                    while (!go)
+                        std::this_thread::yield();
+                    const double t0 = getTime();
+                    double tio = t0;
+                    for (size_t i = 0; i < N / BUFSZ && !interrupted; ++i) {
+                        const off_t off = off_t((gen ? gen->next() : i) * BUFSZ);
+                        const ssize_t n = isWrite ? writeBlock(p, fds[t], pool.next(), pool.count(), off)
+                                                  : readBlock(p, fds[t], pool.next(), pool.count(), off);
+                        if (n <= 0) {
+                            w.err = n < 0 ? errno : EIO;
+                            break;
+                        }
+                        const double now = getTime();
+                        w.lat.add(netLatency(now - tio));
+                        tio = now;
+                        w.bytes += std::uint64_t(n);
+                        progress.add(std::uint64_t(n));
+                    }
+                    if (isWrite && !w.err && !interrupted && fullSync(fds[t]))
+                        w.err = errno;
+                    w.secs = getTime() - t0;
+                });
+
+            while (ready < nTargets)
+                std::this_thread::yield();
+            const CpuUsage cpu0 = CpuUsage::now();
+            progress.start();
+            const double t0 = getTime();
+            go = true;
+            for (auto & th : threads)
+                th.join();
+            const double elapsed = getTime() - t0;
+            const CpuUsage cpu = CpuUsage::now() - cpu0;
+            progress.stop();
+
+            LatencyHistogram lat;
+            std::uint64_t total = 0;
+            for (size_t t = 0; t < nTargets; ++t) {
+                if (workers[t].err) {
+                    std::cerr << "\nError on " << paths[t] << " (" << std::strerror(workers[t].err) << ")" << std::endl;
+                    return isWrite ? 3 : 20;
+                }
+                lat.merge(workers[t].lat);
+                total += workers[t].bytes;
+            }
+            if (!total) // interrupted before anything was transferred: nothing to report
+                return 99;
+
+            out() << "took " << std::fixed << std::setprecision(3) << elapsed << " secs (" << std::setprecision(2)
+                  << total / double(MB) / elapsed << " MB/sec aggregate)" << partialNote() << std::endl;
+            printCpuCost(cpu, lat.count(), total);
+            lat.print();
+            const std::string name = isWrite ? "write" : "read";
+            logResult(p, name, elapsed, total, cpu, lat, progress);
+            for (size_t t = 0; t < nTargets; ++t) {
+                const Worker & w = workers[t];
+                out() << "    Target " << paths[t] << ": " << std::fixed << std::setprecision(2)
+                      << (w.secs > 0. ? w.bytes / double(MB) / w.secs : 0.) << " MB/sec, p50 "
+                      << fmtDuration(w.lat.percentile(50.)) << ", p99 " << fmtDuration(w.lat.percentile(99.))
+                      << ", max " << fmtDuration(w.lat.highest()) << std::endl;
+                logResult(p, name + " " + paths[t], w.secs, w.bytes, CpuUsage(), w.lat, ProgressReporter(0., 0));
+            }
+            return interrupted ? 99 : 0;
+        };
+
+        int res = runPass(true);
+        if (res)
+            return res;
+        for (const auto & path : paths) {
+            Context c = p;
+            c.outfile = path;
+            if ( (res = purgeReadCache(c)) )
+                return res;
+        }
+        return runPass(false);
+    }
+
+    IoVecPool::IoVecPool(size_t n, char *buf, size_t reqSize)
+        : nIov(n)
+    {
+        if (nIov <= 1) {
+            nIov = 1;
+            iovs.push_back({ buf, reqSize });
+            return;
+        }
+        const size_t segSize = reqSize / nIov;
+        for (size_t i = 0; i < DEPTH * nIov; ++i) {
+            segs.push_back(allocBuffer(segSize));
+            std::memcpy(segs.back().get(), buf + (i % nIov) * segSize, segSize);
+            iovs.push_back({ segs.back().get(), segSize });
+        }
+    }
+
+    const struct iovec *IoVecPool::next()
+    {
+        const struct iovec *ret = &iovs[cur * nIov];
+        if (++cur * nIov >= iovs.size())
+            cur = 0;
+        return ret;
+    }
+
+    const char *preallocName(Prealloc mode)
+    {
+        switch (mode) {
+        case Prealloc::Extend: return "extending";
+        case Prealloc::Sparse: return "sparse";
+        case Prealloc::Alloc: return "preallocated";
+        case Prealloc::KeepSize: return "preallocated, keep size";
+        case Prealloc::ZeroRange: return "zero range";
+        }
+        return "";
+    }
+
+    std::vector<Prealloc> preallocModes()
+    {
+#ifdef __linux__
+        return { Prealloc::Extend, Prealloc::Sparse, Prealloc::Alloc, Prealloc::KeepSize, Prealloc::ZeroRange };
+#elif defined(F_PREALLOCATE)
+        return { Prealloc::Extend, Prealloc::Sparse, Prealloc::Alloc, Prealloc::KeepSize };
+#else
+        return { Prealloc::Extend, Prealloc::Sparse };
+#endif
+    }
+
+    DataGenerator::DataGenerator(double compressRatio, double dedupePct, std::uint64_t seed)
+        : ratio(compressRatio), dedupe(dedupePct), rng(seed)
+    {
+        randomBytes = std::max<size_t>(size_t(CHUNK / ratio) / sizeof(std::uint64_t) * sizeof(std::uint64_t), sizeof(std::uint64_t));
+        library.resize(LIBRARY * CHUNK);
+        for (size_t i = 0; i < LIBRARY; ++i)
+            fillChunk(&library[i * CHUNK]);
+    }
+
+    void DataGenerator::fillChunk(char *dst)
+    {
+        std::uint64_t *words = reinterpret_cast<std::uint64_t *>(dst);
+        for (size_t i = 0; i < randomBytes / sizeof(*words); ++i)
+            words[i] = rng.next();
+        std::memset(dst + randomBytes, 0, CHUNK - randomBytes);
+    }
+
+    void DataGenerator::fill(const struct iovec *iov, int iovcnt)
+    {
+        for (int v = 0; v < iovcnt; ++v) {
+            char *seg = static_cast<char *>(iov[v].iov_base);
+            for (size_t off = 0; off + CHUNK <= iov[v].iov_len; off += CHUNK) {
+                if (dedupe > 0. && rng.uniform() * 100. < dedupe)
+                    std::memcpy(seg + off, &library[rng.below(LIBRARY) * CHUNK], CHUNK);
+                else
+                    fillChunk(seg + off);
+            }
+        }
+    }
+
+    std::string DataGenerator::describe() const
+    {
+        std::ostringstream os;
+        os << std::fixed << std::setprecision(1) << ratio << ":1 compressible, " << std::setprecision(0) << dedupe
+           << "% duplicate " << CHUNK / 1024 << " KB chunks";
+        return os.str();
+    }
+
+    bool ResultsLog::save(const std::string & path, const Context & p) const
+    {
+        auto quoted = [](const std::string & str) {
+            std::string ret = "\"";
+            for (const char c : str) {
+                if (c == '"' || c == '\\')
+                    ret += '\\';
+                if (std::uint8_t(c) < 0x20) {
+                    char esc[8];
+                    std::snprintf(esc, sizeof(esc), "\\u%04x", unsigned(c));
+                    ret += esc;
+                } else {
+                    ret += c;
+                }
+            }
+            return ret + '"';
+        };
+
+        std::ofstream f(path);
+        f << std::fixed << std::setprecision(6);
+        f << "{\n  \"version\": " << quoted(VER) << ",\n  \"file\": " << quoted(p.outfile) << ",\n  \"size_mb\": "
+          << p.mb << ",\n  \"interrupted\": " << (interrupted ? "true" : "false");
+        const Calibration & cal = calibration();
+        f << ",\n  \"calibration\": {\"clock\": " << quoted(cal.clock) << ", \"clock_hz\": " << cal.clockHz
+          << ", \"clock_read_ns\": " << cal.clockRead * 1e9 << ", \"clock_resolution_ns\": " << cal.clockResolution * 1e9
+          << ", \"null_syscall_ns\": " << cal.nullSyscall * 1e9 << ", \"memcpy_bytes_per_sec\": " << cal.memcpyBytesPerSec
+          << "}";
+        if (ext.extents)
+            f << ",\n  \"extents\": {\"count\": " << ext.extents << ", \"contiguous_runs\": " << ext.runs
+              << ", \"mapped_bytes\": " << ext.bytes << ", \"avg_extent_bytes\": " << ext.avgExtent()
+              << ", \"avg_run_bytes\": " << ext.avgRun() << "}";
+        f << ",\n  \"phases\": [";
+        for (size_t i = 0; i < list.size(); ++i) {
+            const PhaseResult & r = list[i];
+            f << (i ? "," : "") << "\n    {\"name\": " << quoted(r.name) << ", \"partial\": " << (r.partial ? "true" : "false")
+              << ", \"secs\": " << r.secs << ", \"bytes\": " << r.bytes << ", \"ops\": " << r.ops
+              << ", \"mb_per_sec\": " << r.mbPerSec << ", \"iops\": " << (r.secs > 0. ? r.ops / r.secs : 0.)
+              << ",\n     \"cpu\": {\"user_secs\": " << r.cpu.user << ", \"sys_secs\": " << r.cpu.sys
+              << ", \"voluntary_csw\": " << r.cpu.volCsw << ", \"involuntary_csw\": " << r.cpu.involCsw << "}"
+              << ",\n     \"latency_us\": {\"min\": " << r.lat.lowest() * 1e6 << ", \"avg\": " << r.lat.mean() * 1e6;
+            for (const double pct : { 50., 90., 99., 99.9 })
+                f << ", \"p" << std::defaultfloat << pct << std::fixed << "\": " << r.lat.percentile(pct) * 1e6;
+            f << ", \"max\": " << r.lat.highest() * 1e6 << "},\n     \"series\": [";
+            for (size_t j = 0; j < r.series.size(); ++j)
+                f << (j ? ", " : "") << "{\"t\": " << r.series[j].t << ", \"bytes\": " << r.series[j].bytes
+                  << ", \"ops\": " << r.series[j].ops << "}";
+            f << "]";
+            if (!r.writeback.empty()) {
+                f << ",\n     \"writeback\": [";
+                for (size_t j = 0; j < r.writeback.size(); ++j) {
+                    const WritebackSample & w = r.writeback[j];
+                    f << (j ? "," : "") << "\n      {\"t\": " << w.t << ", \"bytes\": " << w.bytes << ", \"max_latency_us\": "
+                      << w.maxLatency * 1e6 << ", \"stalls\": " << w.stalls << ", \"dirty\": " << w.dirty
+                      << ", \"writeback\": " << w.writeback << ", \"flushed\": " << w.flushed << ", \"threshold\": "
+                      << w.threshold << "}";
+                }
+                f << "]";
+            }
+            f << "}";
+        }
+        f << "\n  ]\n}\n";
+        f.close();
+        if (!f)
+            std::cerr << "Failed to write results file " << path << std::endl;
+        return bool(f);
+    }
+
+    std::vector<TraceRecord> loadTrace(const std::string & path)
+    {
+        std::ifstream f(path);
+        if (!f)
+            throw std::runtime_error("cannot open file");
+        std::vector<TraceRecord> ret;
+        std::string line;
+        for (size_t lineNo = 1; std::getline(f, line); ++lineNo) {
+            const auto first = line.find_first_not_of(" \t\r");
+            if (first == std::string::npos || line[first] == '#')
+                continue;
+            std::istringstream is(line);
+            TraceRecord r = {};
+            std::string op;
+            is >> r.ts >> op >> r.offset >> r.length;
+            if (!is || (op != "R" && op != "W" && op != "r" && op != "w") || !r.length)
+                throw std::runtime_error("bad record on line " + std::to_string(lineNo));
+            r.op = char(std::toupper(op[0]));
+            if (!(is >> r.thread))
+                r.thread = 0; // thread id is optional
+            ret.push_back(r);
+        }
+        return ret;
+    }
+
+    bool TraceRecorder::save(const std::string & path) const
+    {
+        std::ofstream f(path);
+        f << "# sbench trace: TIMESTAMP_SECS OP OFFSET LENGTH [THREAD]\n" << std::fixed << std::setprecision(9);
+        for (const auto & r : recs)
+            f << r.ts << ' ' << r.op << ' ' << r.offset << ' ' << r.length << ' ' << r.thread << '\n';
+        f.close();
+        if (!f)
+            std::cerr << "Failed to write trace file " << path << std::endl;
+        return bool(f);
+    }
+
+    /* static */ AccessPattern AccessPattern::parse(const std::string & spec)
+    {
+        std::vector<std::string> parts;
+        for (size_t pos = 0; ; ) {
+            const auto colon = spec.find(':', pos);
+            parts.push_back(spec.substr(pos, colon - pos));
+            if (colon == std::string::npos)
+                break;
+            pos = colon + 1;
+        }
+        auto param = [&parts](size_t i, double def) -> double {
+            if (i >= parts.size())
+                return def;
+            size_t pos = 0;
+            const double d = std::stod(parts[i], &pos);
+            if (pos < parts[i].length())
+                throw std::runtime_error("extra characters at end of parameter");
+            return d;
+        };
+
+        AccessPattern ret;
+        const std::string & name = parts[0];
+        size_t maxParams = 0;
+        if (name == "seq") {
+            ret.kind = Seq;
+        } else if (name == "uniform") {
+            ret.kind = Uniform;
+        } else if (name == "zipf") {
+            ret.kind = Zipf;
+            ret.a = param(1, 0.99); // theta
+            maxParams = 1;
+            if (!(ret.a > 0. && ret.a < 1.))
+                throw std::runtime_error("zipf theta must be in (0, 1)");
+        } else if (name == "pareto") {
+            ret.kind = Pareto;
+            ret.a = param(1, 1.16); // shape; log4(5) gives the classic 80/20 split
+            maxParams = 1;
+            if (!(ret.a > 0.))
+                throw std::runtime_error("pareto shape must be > 0");
+        } else if (name == "hotcold") {
+            ret.kind = HotCold;
+            ret.a = param(1, 90.); // percentage of ops ...
+            ret.b = param(2, 10.); // ... going to this percentage of the data
+            maxParams = 2;
+            if (!(ret.a >= 0. && ret.a <= 100. && ret.b > 0. && ret.b < 100.))
+                throw std::runtime_error("hotcold percentages must be within 0-100");
+        } else if (name == "gauss") {
+            ret.kind = Gauss;
+            ret.a = param(1, 0.1); // standard deviation as a fraction of the file, centered on its middle
+            maxParams = 1;
+            if (!(ret.a > 0.))
+                throw std::runtime_error("gauss stddev must be > 0");
+        } else {
+            throw std::runtime_error("unknown pattern");
+        }
+        if (parts.size() > maxParams + 1)
+            throw std::runtime_error("too many pattern parameters");
+        return ret;
+    }
+
+    std::string AccessPattern::describe() const
+    {
+        std::ostringstream os;
+        switch (kind) {
+        case Seq: os << "sequential"; break;
+        case Uniform: os << "uniform random"; break;
+        case Zipf: os << "zipf theta=" << a; break;
+        case Pareto: os << "pareto shape=" << a; break;
+        case HotCold: os << "hot/cold " << a << "% of ops to " << b << "% of data"; break;
+        case Gauss: os << "gaussian stddev=" << a; break;
+        }
+        return os.str();
+    }
+
+    OffsetGenerator::OffsetGenerator(const AccessPattern & pat_, size_t nBlocks, std::uint64_t seed)
+        : pat(pat_), n(std::max<size_t>(nBlocks, 1)), rng(seed)
+    {
+        if (pat.kind == AccessPattern::Zipf || pat.kind == AccessPattern::Pareto || pat.kind == AccessPattern::HotCold) {
+            perm.resize(n);
+            for (size_t i = 0; i < n; ++i)
+                perm[i] = std::uint32_t(i);
+            for (size_t i = n - 1; i > 0; --i) // Fisher-Yates
+                std::swap(perm[i], perm[rng.below(i + 1)]);
+        }
+        if (pat.kind == AccessPattern::Zipf) {
+            // Gray et al., "Quickly Generating Billion-Record Synthetic Databases" (as used by YCSB)
+            const double theta = pat.a;
+            for (size_t i = 1; i <= n; ++i)
+                zetan += 1. / std::pow(double(i), theta);
+            const double zeta2 = 1. + 1. / std::pow(2., theta);
+            alpha = 1. / (1. - theta);
+            eta = (1. - std::pow(2. / n, 1. - theta)) / (1. - zeta2 / zetan);
+            halfPowTheta = 1. + std::pow(0.5, theta);
+        } else if (pat.kind == AccessPattern::Pareto) {
+            loPow = 1.; // lower bound 1 raised to the shape
+            hiPow = std::pow(double(n), pat.a);
+        }
+    }
+
+    size_t OffsetGenerator::next()
+    {
+        size_t rank = 0;
+        switch (pat.kind) {
+        case AccessPattern::Seq:
+        case AccessPattern::Uniform:
+            return size_t(rng.below(n));
+        case AccessPattern::Zipf: {
+            const double u = rng.uniform(), uz = u * zetan;
+            if (uz < 1.)
+                rank = 0;
+            else if (uz < halfPowTheta)
+                rank = 1;
+            else
+                rank = size_t(n * std::pow(eta * u - eta + 1., alpha));
+            break;
+        }
+        case AccessPattern::Pareto: {
+            // inverse CDF of the Pareto distribution bounded to [1, n]
+            const double u = rng.uniform();
+            const double x = std::pow(-(u * hiPow - u * loPow - hiPow) / (hiPow * loPow), -1. / pat.a);
+            rank = size_t(x) - 1;
+            break;
+        }
+        case AccessPattern::HotCold: {
+            const size_t nHot = std::max<size_t>(size_t(n * pat.b / 100.), 1);
+            if (rng.uniform() * 100. < pat.a || nHot >= n)
+                rank = size_t(rng.below(nHot));
+            else
+                rank = nHot + size_t(rng.below(n - nHot));
+            break;
+        }
+        case AccessPattern::Gauss: {
+            // Box-Muller; out of range samples are redrawn, which stays O(1) on average for any sane stddev
+            double z;
+            do {
+                if (haveSpare) {
+                    z = spare;
+                    haveSpare = false;
+                } else {
+                    const double u1 = 1. - rng.uniform(), u2 = rng.uniform();
+                    const double r = std::sqrt(-2. * std::log(u1));
+                    z = r * std::cos(2. * M_PI * u2);
+                    spare = r * std::sin(2. * M_PI * u2);
+                    haveSpare = true;
+                }
+                z = n / 2. + z * pat.a * n;
+            } while (z < 0. || z >= double(n));
+            return size_t(z); // no permutation: gaussian models spatial locality around the file's middle
+        }
+        }
+        return perm[std::min(rank, n - 1)];
+    }
+
+    ProgressReporter::ProgressReporter(double interval_, std::uint64_t totalBytes)
+        : interval(interval_), total(totalBytes), active(interval_ > 0.)
+    {}
+
+    void ProgressReporter::start()
+    {
+        if (active && !thr.joinable())
+            thr = std::thread([this]{ run(); });
+    }
+
+    void ProgressReporter::stop()
+    {
+        if (!thr.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> g(mut);
+            stopping = true;
+        }
+        cond.notify_one();
+        thr.join();
+    }
+
+    void ProgressReporter::run()
+    {
+        const double t0 = getTime();
+        double tPrev = t0;
+        std::uint64_t prevBytes = 0, prevOps = 0;
+        bool first = true;
+        std::unique_lock<std::mutex> lock(mut);
+        while (!cond.wait_for(lock, std::chrono::duration<double>(interval), [this]{ return stopping; })) {
+            const double t = getTime();
+            const std::uint64_t bytes = doneBytes.load(std::memory_order_relaxed), ops = doneOps.load(std::memory_order_relaxed);
+            const double dt = t - tPrev, rate = (bytes - prevBytes) / dt;
+            // the phase's opening message has no newline yet: start the progress lines below it
+            out() << (first ? "\n" : "") << "    " << std::fixed << std::setprecision(1) << std::setw(7) << (t - t0)
+                  << "s";
+            if (total)
+                out() << " [" << std::setw(5) << (100. * bytes / total) << "%]";
+            out() << " " << std::setprecision(2) << std::setw(9) << (rate / MB) << " MB/sec, " << std::setprecision(0)
+                  << std::setw(7) << ((ops - prevOps) / dt) << " IOPS";
+            if (total && bytes && bytes < total)
+                out() << ", ETA " << fmtDuration((t - t0) * (total - bytes) / bytes);
+            out() << std::endl;
+            series.push_back({t - t0, bytes, ops});
+            first = false;
+            tPrev = t;
+            prevBytes = bytes;
+            prevOps = ops;
+        }
+    }
+
+    /* static */ int LatencyHistogram::bucketOf(std::uint64_t ns)
+    {
+        if (ns < SUB)
+            return int(ns);
+        const int msb = 63 - __builtin_clzll(ns);
+        const int shift = msb - SUB_BITS;
+        return (shift + 1) * SUB + int((ns >> shift) & (SUB - 1));
+    }
+
+    /* static */ double LatencyHistogram::valueOf(int bucket)
+    {
+        if (bucket < SUB)
+            return bucket;
+        const int shift = bucket / SUB - 1;
+        const double lo = double(std::uint64_t(SUB + bucket % SUB) << shift);
+        return lo + double(std::uint64_t(1) << shift) / 2.;
+    }
+
+    void LatencyHistogram::add(double secs)
+    {
+        if (secs < 0.)
+            secs = 0.;
+        ++buckets[bucketOf(std::uint64_t(secs * 1e9))];
+        if (!n++ || secs < min)
+            min = secs;
+        if (secs > max)
+            max = secs;
+        sum += secs;
+    }
+
+    double LatencyHistogram::percentile(double pct) const
+    {
+        if (!n)
+            return 0.;
+        const double target = pct / 100. * n;
+        std::uint64_t seen = 0;
+        for (int b = 0; b < int(sizeof(buckets)/sizeof(*buckets)); ++b) {
+            seen += buckets[b];
+            if (buckets[b] && seen >= target)
+                return std::min(std::max(valueOf(b) / 1e9, min), max);
+        }
+        return max;
+    }
+
+    void LatencyHistogram::merge(const LatencyHistogram & o)
+    {
+        if (!o.n)
+            return;
+        for (size_t i = 0; i < sizeof(buckets)/sizeof(*buckets); ++i)
+            buckets[i] += o.buckets[i];
+        min = n ? std::min(min, o.min) : o.min;
+        max = std::max(max, o.max);
+        sum += o.sum;
+        n += o.n;
+    }
+
+    void LatencyHistogram::print(const char *label) const
+    {
+        if (!n)
+            return;
+        out() << "    " << label << ": min " << fmtDuration(min) << ", avg " << fmtDuration(sum / n)
+              << ", p50 " << fmtDuration(percentile(50.)) << ", p90 " << fmtDuration(percentile(90.))
+              << ", p99 " << fmtDuration(percentile(99.)) << ", p99.9 " << fmtDuration(percentile(99.9))
+              << ", max " << fmtDuration(max) << std::endl;
+    }
+
+    /* static */ CpuUsage CpuUsage::now()
+    {
+        CpuUsage u;
+        struct rusage ru;
+        // RUSAGE_SELF covers all threads of the process, so this stays correct if the work is spread across threads
+        if (::getrusage(RUSAGE_SELF, &ru) == 0) {
+            u.user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+            u.sys = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+            u.volCsw = ru.ru_nvcsw;
+            u.involCsw = ru.ru_nivcsw;
+        }
+        return u;
+    }
+
+    CpuUsage CpuUsage::operator-(const CpuUsage & o) const
+    {
+        CpuUsage u;
+        u.user = user - o.user;
+        u.sys = sys - o.sys;
+        u.volCsw = volCsw - o.volCsw;
+        u.involCsw = involCsw - o.involCsw;
+        return u;
+    }
+
+#ifdef __linux__
+    PerfCounters::PerfCounters(bool en)
+        : enabled(en)
+    {
+        for (auto & c : ctrs)
+            c.fd = -1;
+        if (!enabled)
+            return;
+
+        const struct { const char *name; std::uint32_t type; std::uint64_t config; } events[NCOUNTERS] = {
+            { "cycles",       PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+            { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+            { "cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+            { "dTLB-misses",  PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                                                  | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+            { "ctx-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+        };
+
+        auto open = [&](int i) -> int {
+            struct perf_event_attr attr = {};
+            attr.size = sizeof(attr);
+            attr.type = events[i].type;
+            attr.config = events[i].config;
+            attr.disabled = 1;
+            attr.inherit = 1; // also count any threads we spawn
+            attr.exclude_hv = 1;
+            attr.exclude_kernel = userOnly;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            return int(::syscall(SYS_perf_event_open, &attr, 0 /* this process */, -1 /* any cpu */, -1, 0));
+        };
+
+        int nOpened = 0;
+        for (int i = 0; i < NCOUNTERS; ++i) {
+            ctrs[i].name = events[i].name;
+            ctrs[i].fd = open(i);
+            if (ctrs[i].fd < 0 && (errno == EACCES || errno == EPERM) && !userOnly) {
+                // perf_event_paranoid forbids kernel profiling: retry everything counting user space only
+                for (int j = 0; j < i; ++j)
+                    if (ctrs[j].fd >= 0) { ::close(ctrs[j].fd); ctrs[j].fd = -1; }
+                userOnly = true;
+                nOpened = 0;
+                i = -1;
+                continue;
+            }
+            if (ctrs[i].fd >= 0)
+                ++nOpened;
+        }
+        if (!nOpened) {
+            std::cerr << "(perf_event_open failed: " << std::strerror(errno) << ", counters disabled)" << std::endl;
+            enabled = false;
+        }
+    }
+
+    PerfCounters::~PerfCounters()
+    {
+        for (auto & c : ctrs)
+            if (c.fd >= 0)
+                ::close(c.fd);
+    }
+
+    void PerfCounters::start()
+    {
+        for (auto & c : ctrs)
+            if (c.fd >= 0) {
+                ::ioctl(c.fd, PERF_EVENT_IOC_RESET, 0);
+                ::ioctl(c.fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+    }
+
+    void PerfCounters::stop()
+    {
+        for (auto & c : ctrs) {
+            if (c.fd < 0)
+                continue;
+            ::ioctl(c.fd, PERF_EVENT_IOC_DISABLE, 0);
+            std::uint64_t v[3] = {}; // value, time enabled, time running
+            if (::read(c.fd, v, sizeof(v)) != ssize_t(sizeof(v)))
+                continue;
+            // scale up if the PMU was multiplexed between more events than it has hardware counters for
+            c.value = v[2] && v[2] < v[1] ? std::uint64_t(double(v[0]) * v[1] / v[2]) : v[0];
+        }
+    }
+#else
+    PerfCounters::PerfCounters(bool en)
+        : enabled(en)
+    {
+        for (auto & c : ctrs)
+            c.fd = -1;
+        if (enabled) {
+            std::cerr << "(performance counters are only supported on Linux, counters disabled)" << std::endl;
+            enabled = false;
+        }
+    }
+
+    PerfCounters::~PerfCounters() {}
+    void PerfCounters::start() {}
+    void PerfCounters::stop() {}
+#endif
+
+    void PerfCounters::print(size_t nOps) const
+    {
+        if (!enabled)
+            return;
+        out() << "    Counters" << (userOnly ? " (user space only)" : "") << ":";
+        const char *sep = " ";
+        for (const auto & c : ctrs) {
+            if (c.fd < 0)
+                continue;
+            out() << sep << c.name << " " << c.value;
+            if (nOps)
+                out() << " (" << std::fixed << std::setprecision(1) << (double(c.value) / nOps) << "/IO)";
+            sep = ", ";
+        }
+        if (ctrs[0].fd >= 0 && ctrs[1].fd >= 0 && ctrs[0].value)
+            out() << ", IPC " << std::setprecision(2) << (double(ctrs[1].value) / ctrs[0].value);
+        out() << std::endl;
+    }
+} // end namespace sbench
@@ -1,58 +1,24 @@
-#include <chrono>
-#include <cstddef>
-#include <cstdint>
-#include <cstdlib>
-#include <functional>
-#include <iomanip>
+#include <algorithm>
 #include <iostream>
-#include <memory>
-#include <random>
+#include <iterator>
+#include <set>
+#include <stdexcept>
 #include <string>
+#include <vector>
 
-#include <fcntl.h>
 #include <signal.h>
-#include <sys/stat.h>
-#include <unistd.h>
 
-namespace {
-    // define some constants we use
-    constexpr size_t MB = 1024*1024;
-    constexpr size_t BUFSZ = MB;
-    const char *VER = "1.2"; // program version
-
-    volatile bool interrupted = false; // flag set when SIGINT received
+#include "sbench.h"
 
-    struct Context
-    {
-        std::string outfile;
-        size_t mb = 2*1024;  // 2 GB default size
-        bool valid = false, outfileCreated = false;
-
-        operator bool() const { return valid; }
-    };
+// the command line front end; the benchmarks themselves live in libsbench (see sbench.h)
+using namespace sbench;
 
+namespace {
     Context parseArgs(int argc, const char * const * argv);
 
-    // returns relative time since program start in seconds (uses high precision clock)
-    double getTime();
-
-    int doRead(const Context & p);
-    int doWrite(Context & p);
-
-    // Kind of like Go's "defer" statement. Call a functor (for clean-up code) at scope end.
-    struct Defer
-    {
-        std::function<void(void)> func;
-
-        Defer(const std::function<void(void)> & f) : func(f) {}
-        Defer(std::function<void(void)> && f) : func(std::move(f)) {}
-
-        ~Defer() { if (func) func(); }
-    };
-
     void sigHandler(int sig)
     {
-        interrupted = true;
+        interrupt();
         std::cerr << "(Caught signal " << sig << ", will exit)" << std::endl;
     }
 }
@@ -71,155 +37,12 @@ int main(int argc, char **argv)
     ::signal(SIGTERM, sigHandler);
     ::signal(SIGHUP, sigHandler);
 
-    Defer defer_RmOutfile([&p]{
-        if (p.outfileCreated) {
-            if (unlink(p.outfile.c_str())) {
-                std::cerr << "Failed to remove file " << p.outfile << std::endl;
-            } else {
-                p.outfileCreated = false;
-                std::cerr << "(Removed " << p.outfile << ")" << std::endl;
-            }
-        }
-    });
-
-    int res;
-    res = doWrite(p);
-    if (res)
-        return res;
-    res = doRead(p);
-
-    return res;
+    return run(p);
 }
 
 
 namespace {
 
-    int doRead(const Context & p)
-    {
-        std::cout << "Running /usr/sbin/purge with sudo (clearing read cache)..." << std::endl;
-        // purge command clears read caches
-        int res = std::system("/usr/bin/sudo /usr/sbin/purge");
-        if (res) {
-            std::cerr << "Failed to execute purge, exit code: " << res << std::endl;
-            return res;
-        }
-        std::cout << "Reading back " << p.outfile << "..." << std::flush;
-        int fd = ::open(p.outfile.c_str(), O_RDONLY | O_CLOEXEC);
-        if (fd < 0) {
-            std::cerr << "\nError opening file" << std::endl;
-            return 10;
-        }
-
-        Defer defer_CloseFd([&fd]{
-            if (fd >= 0) {
-                ::close(fd);
-                fd = -1;
-            }
-        });
-
-        res = ::fcntl(fd, F_NOCACHE, 1);  // turn off read cache
-        if (res) {
-            std::cerr << "\nfcntl(F_NOCACHE) returned " << res << std::endl;
-            return 11;
-        }
-
-        auto buf = std::make_unique<char[]>(BUFSZ); // we allocate data on the heap, BUFSZ bytes
-        size_t count = 0;
-        ssize_t nread = 0;
-
-        double t0 = getTime();
-
-        while ( (nread = ::read(fd, buf.get(), BUFSZ)) > 0 && !interrupted) {
-            count += nread;
-        }
-
-        if (interrupted)
-            return 99;
-
-        if (count) {
-            const double elapsed = getTime() - t0;
-            const double n_MB = count/double(MB);
-            std::cout << "took " << std::fixed << std::setprecision(3) << elapsed << " secs (" << std::setprecision(2) << (n_MB/elapsed) << " MB/sec)" << std::endl;
-        } else {
-            std::cerr << "Error reading!" << std::endl;
-            return 20;
-        }
-
-        return 0;
-    }
-
-    int doWrite(Context & p)
-    {
-        const size_t N = p.mb * MB;
-
-        if (N < BUFSZ) {
-            std::cerr << "Invalid output size specified: " << N << std::endl;
-            return 2;
-        }
-
-        struct MyFailure : public std::runtime_error {
-            using std::runtime_error::runtime_error; // explicitly inherit c'tor
-        };
-
-        double t0; // starts off uninitialized but will be initialized once we begin writing below...
-
-        try {
-            int fd = ::open(p.outfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
-            if (fd < 0)
-                throw MyFailure("cannot open file for writing");
-            p.outfileCreated = true;
-
-            Defer defered_close([&fd]{
-                if (fd >= 0) {
-                    ::close(fd);
-                    fd = -1;
-                }
-            });
-
-            if (::fcntl(fd, F_NOCACHE, 1))
-                throw MyFailure("failed to disable write caching");
-
-            auto buf = std::make_unique<char[]>(BUFSZ); // we allocate data on the heap, BUFSZ bytes
-
-            {   // assign random data to buf
-                std::cout << "Generating random data..." << std::flush;
-                double t0 = getTime();
-                std::mt19937_64 rgen;
-                rgen.seed(std::chrono::system_clock::now().time_since_epoch().count());
-                std::uniform_int_distribution<std::uint64_t> dist(0);
-                std::uint64_t *words = reinterpret_cast<std::uint64_t *>(buf.get());
-                for (size_t i = 0; i < BUFSZ/sizeof(*words); ++i) {
-                    words[i] = dist(rgen);
-                }
-                std::cout << "took " << std::fixed << std::setprecision(3) << (getTime()-t0) << " seconds" << std::endl;
-            }
-
-            std::cout << "Writing " << p.mb << " MB to " << p.outfile << "..." << std::flush;
-
-            t0 = getTime(); // mark write start time
-
-            for (size_t i = 0; i < N/BUFSZ && !interrupted; ++i) {
-                auto n = ::write(fd, buf.get(), BUFSZ);
-                if (n <= 0)
-                    throw MyFailure("write failure");
-            }
-            if (interrupted)
-                return 99;
-            ::fcntl(fd, F_FULLFSYNC, 1); // wait for write buffers to write back to device.
-        } catch (const MyFailure &e) {
-            std::cerr << "Error on " <<  p.outfile << " (" << e.what() << ")" << std::endl;
-            return 3;
-        }
-
-        const double elapsed = getTime() - t0;
-        const double mbsec = p.mb / elapsed;
-
-        std::cout << "took " << std::fixed << std::setprecision(3) << elapsed << " seconds"
-                  << " (" << std::setprecision(2) << mbsec << " MB/sec)" << std::endl;
-
-        return 0;
-    }
-
     Context parseArgs(int argc, const char * const * argv)
     {
         Context p;
@@ -232,19 +55,255 @@ namespace {
                     std::cerr << "OSX Simple SSD Benchmark " << VER << std::endl;
                     std::cerr << "© 2019 Calin Culianu <calin.culianu@gmail.com>" << std::endl << std::endl;
                 }
-                std::cerr << "Usage: \t" << progname << " outfile" << " [SIZE_MB]" << std::endl;
+                std::cerr << "Usage: \t" << progname << " [options] outfile" << " [SIZE_MB]" << std::endl << std::endl;
+                std::cerr << "Options:" << std::endl;
+                std::cerr << "    --counters    report per-phase performance counters (Linux perf_event_open)" << std::endl;
+                std::cerr << "    --polled      use polled completions (RWF_HIPRI) in the read and write loops (Linux)" << std::endl;
+                std::cerr << "    --iovecs=N    vectored I/O: gather each 1 MB request from N separate buffers (readv/writev)" << std::endl;
+                std::cerr << "    --pattern=P   read pass offsets: seq (default), uniform, zipf[:THETA], pareto[:SHAPE]," << std::endl;
+                std::cerr << "                  hotcold[:OPS_PCT:DATA_PCT], gauss[:STDDEV_FRACTION]" << std::endl;
+                std::cerr << "    --replay=FILE replay an I/O trace (TIMESTAMP R|W OFFSET LENGTH [THREAD] per line) instead" << std::endl;
+                std::cerr << "                  of the read pass" << std::endl;
+                std::cerr << "    --faithful    replay honoring trace timestamps instead of as fast as possible" << std::endl;
+                std::cerr << "    --record=FILE record the write and read passes to FILE in the same trace format" << std::endl;
+                std::cerr << "    --threads=N   worker threads for the multi-threaded workloads (default 1)" << std::endl;
+                std::cerr << "    --metadata=N  instead of the write/read passes, time create, fsync-dir, open, stat, rename" << std::endl;
+                std::cerr << "                  and unlink of N small files in a new directory tree at outfile" << std::endl;
+                std::cerr << "    --syncrange[=MB] write through the page cache instead, starting write-back every MB" << std::endl;
+                std::cerr << "                  (default 8) and waiting on and dropping the range before (sync_file_range)" << std::endl;
+                std::cerr << "    --copy        after the write pass(es), copy the file with read()+write(), copy_file_range," << std::endl;
+                std::cerr << "                  sendfile and splice (fcopyfile on macOS), comparing throughput and CPU/GB" << std::endl;
+                std::cerr << "    --membw       first measure memcpy, memset and STREAM triad bandwidth with the same" << std::endl;
+                std::cerr << "                  buffers and threads, then report each phase as a fraction of it" << std::endl;
+                std::cerr << "    --stalls[=MS] instead of the direct I/O passes, stream buffered writes and report writes" << std::endl;
+                std::cerr << "                  slower than MS (default 100) against page cache state from /proc/vmstat" << std::endl;
+                std::cerr << "    --append[=BYTES] instead of the direct I/O passes, append BYTES (default 4096) records from" << std::endl;
+                std::cerr << "                  every thread to shared segment files outfile.0, outfile.1... with O_APPEND" << std::endl;
+                std::cerr << "    --reserve     with --append, reserve each record's offset with fetch_add and pwrite() it" << std::endl;
+                std::cerr << "    --segment=MB  with --append, roll over to a new segment file every MB (default 64)" << std::endl;
+                std::cerr << "    --fsync=MS    with --append, fsync the active segment every MS milliseconds" << std::endl;
+                std::cerr << "    --tail        instead of the direct I/O passes, write the file while --threads readers read" << std::endl;
+                std::cerr << "                  back each block as soon as it is written, timing read-after-write latency" << std::endl;
+                std::cerr << "                  and verifying every block read is complete" << std::endl;
+                std::cerr << "    --buffered    instead of the direct I/O passes, write through the page cache, time the" << std::endl;
+                std::cerr << "                  flush of the dirty pages, and read back from the cache" << std::endl;
+                std::cerr << "    --scale[=MAX[:GAIN_PCT[:P99_MS]]] instead of the read pass, read with 1, 2, 4... threads" << std::endl;
+                std::cerr << "                  (up to MAX, default 64) until a step gains under GAIN_PCT (default 10)" << std::endl;
+                std::cerr << "                  or p99 exceeds P99_MS, and report the knee point" << std::endl;
+                std::cerr << "    --target=FILE also benchmark FILE (repeatable): write and read outfile and every target" << std::endl;
+                std::cerr << "                  concurrently, one worker each, reporting each target and the aggregate" << std::endl;
+                std::cerr << "    --compress=R  write data compressible at about R:1 (generated per block)" << std::endl;
+                std::cerr << "    --dedupe=PCT  make PCT percent of written 4 KB chunks duplicates (generated per block)" << std::endl;
+                std::cerr << "    --prealloc=M  file layout before the write pass: extend (default), sparse, alloc, keepsize," << std::endl;
+                std::cerr << "                  zero (Linux), or compare to run the write pass in each mode" << std::endl;
+                std::cerr << "    --overwrite   after the write pass, overwrite the file in place sequentially, then in" << std::endl;
+                std::cerr << "                  random order, reporting each pass separately" << std::endl;
+                std::cerr << "    --extents     after the write pass(es), report the file's extents and physically contiguous" << std::endl;
+                std::cerr << "                  runs (FIEMAP, F_LOG2PHYS_EXT on macOS) and relate them to read throughput" << std::endl;
+                std::cerr << "    --fragment=MB fragment the file on purpose: write 1 MB to a filler file after every MB of" << std::endl;
+                std::cerr << "                  it in the write pass, removing the filler afterwards" << std::endl;
+                std::cerr << "    --discard[=MB] after the write pass(es), discard the file (punch hole, or BLKDISCARD on a" << std::endl;
+                std::cerr << "                  Linux block device) in MB chunks (default 16), then re-measure writing" << std::endl;
+                std::cerr << "    --progress[=SECS] print MB/sec, IOPS, percentage and ETA every SECS (default 1) during" << std::endl;
+                std::cerr << "                  each phase" << std::endl;
+                std::cerr << "    --results=FILE write each phase's results (throughput, CPU, latency percentiles, progress" << std::endl;
+                std::cerr << "                  samples) to FILE as JSON, marking phases cut short by an interrupt as partial" << std::endl;
                 if (showBanner) {
                     std::cerr << std::endl; // additional newline if banner mode
                 }
             };
 
-            if (argc < 2 || argc > 3) {
+            // parses a positive integer, throwing on anything else
+            auto parsePositive = [](const std::string & s) -> long {
+                size_t pos = 0;
+                long n = std::stol(s, &pos);
+                if (n <= 0)
+                    throw std::runtime_error("must be > 0");
+                if (pos < s.length())
+                    throw std::runtime_error("extra characters at end of string");
+                return n;
+            };
+
+            // parses a floating point number within [lo, hi], throwing on anything else
+            auto parseDouble = [](const std::string & s, double lo, double hi) -> double {
+                size_t pos = 0;
+                const double d = std::stod(s, &pos);
+                if (!(d >= lo && d <= hi))
+                    throw std::runtime_error("out of range");
+                if (pos < s.length())
+                    throw std::runtime_error("extra characters at end of string");
+                return d;
+            };
+
+            // parse options, which precede the positional arguments. Options taking a value use --name=value
+            int i = 1;
+            std::set<std::string> given; // option names seen, for the conflict checks below
+            for ( ; i < argc && argv[i][0] == '-' && argv[i][1]; ++i) {
+                const std::string arg(argv[i]);
+                const auto eq = arg.find('=');
+                const std::string opt = arg.substr(0, eq), val = eq == std::string::npos ? "" : arg.substr(eq + 1);
+                given.insert(opt);
+                try {
+                    if (opt == "--counters") {
+                        p.counters = true;
+                    } else if (opt == "--polled") {
+                        if (!polledSupported())
+                            throw std::runtime_error("not supported on this platform");
+                        p.polled = true;
+                    } else if (opt == "--iovecs") {
+                        const long n = parsePositive(val);
+                        // every segment must stay a multiple of the page size for uncached (direct) I/O
+                        if (BUFSZ % n || (BUFSZ / n) % 4096)
+                            throw std::runtime_error("must divide 1 MB into multiples of 4 KB, i.e. a power of 2 up to 256");
+                        p.iovecs = size_t(n);
+                    } else if (opt == "--pattern") {
+                        p.pattern = AccessPattern::parse(val);
+                    } else if (opt == "--replay" || opt == "--record" || opt == "--results") {
+                        if (val.empty())
+                            throw std::runtime_error("missing file name");
+                        (opt == "--replay" ? p.replayFile : opt == "--record" ? p.recordFile : p.resultsFile) = val;
+                    } else if (opt == "--syncrange") {
+                        p.syncRangeMB = val.empty() ? 8 : size_t(parsePositive(val));
+                    } else if (opt == "--copy") {
+                        p.copy = true;
+                    } else if (opt == "--membw") {
+                        p.memBandwidth = true;
+                    } else if (opt == "--stalls") {
+                        p.stallSecs = (val.empty() ? 100. : parseDouble(val, 0.001, 1e6)) / 1e3;
+                    } else if (opt == "--append") {
+                        p.appendRecord = val.empty() ? 4096 : size_t(parsePositive(val));
+                    } else if (opt == "--reserve") {
+                        p.appendReserve = true;
+                    } else if (opt == "--segment") {
+                        p.segmentMB = size_t(parsePositive(val));
+                    } else if (opt == "--fsync") {
+                        p.appendSyncSecs = parseDouble(val, 0.001, 1e6) / 1e3;
+                    } else if (opt == "--tail") {
+                        p.tail = true;
+                    } else if (opt == "--buffered") {
+                        p.buffered = true;
+                    } else if (opt == "--scale") {
+                        // MAX[:MIN_GAIN_PCT[:P99_LIMIT_MS]], every part optional
+                        std::vector<std::string> parts;
+                        for (size_t pos = 0; ; ) {
+                            const auto colon = val.find(':', pos);
+                            parts.push_back(val.substr(pos, colon - pos));
+                            if (colon == std::string::npos)
+                                break;
+                            pos = colon + 1;
+                        }
+                        if (parts.size() > 3)
+                            throw std::runtime_error("too many parameters");
+                        p.scaleMax = parts[0].empty() ? 64 : size_t(parsePositive(parts[0]));
+                        if (parts.size() > 1)
+                            p.scaleMinGain = parseDouble(parts[1], 0., 1000.);
+                        if (parts.size() > 2)
+                            p.scaleP99Limit = parseDouble(parts[2], 0.001, 1e6) / 1e3;
+                    } else if (opt == "--target") {
+                        if (val.empty())
+                            throw std::runtime_error("missing file name");
+                        p.targets.push_back(val);
+                    } else if (opt == "--faithful") {
+                        p.faithful = true;
+                    } else if (opt == "--threads") {
+                        p.threads = size_t(parsePositive(val));
+                    } else if (opt == "--metadata") {
+                        p.metadataFiles = size_t(parsePositive(val));
+                    } else if (opt == "--compress") {
+                        p.compress = parseDouble(val, 1., double(DATA_CHUNK));
+                    } else if (opt == "--dedupe") {
+                        p.dedupe = parseDouble(val, 0., 100.);
+                    } else if (opt == "--progress") {
+                        p.progressInterval = val.empty() ? 1. : parseDouble(val, 0.01, 86400.);
+                    } else if (opt == "--discard") {
+                        p.discardChunkMB = val.empty() ? 16 : size_t(parsePositive(val));
+                    } else if (opt == "--extents") {
+                        p.extents = true;
+                    } else if (opt == "--fragment") {
+                        p.fragmentMB = size_t(parsePositive(val));
+                    } else if (opt == "--overwrite") {
+                        p.overwrite = true;
+                    } else if (opt == "--prealloc") {
+                        const auto modes = preallocModes();
+                        const auto it = std::find_if(modes.begin(), modes.end(), [&val](Prealloc m) {
+                            const char *names[] = { "extend", "sparse", "alloc", "keepsize", "zero" };
+                            return val == names[int(m)];
+                        });
+                        if (val == "compare")
+                            p.preallocCompare = true;
+                        else if (it != modes.end())
+                            p.prealloc = *it;
+                        else
+                            throw std::runtime_error("unknown or unsupported mode");
+                    } else {
+                        throw std::runtime_error("unknown option");
+                    }
+                } catch (const std::exception & e) {
+                    std::cerr << "Bad option " << arg << " (" << e.what() << ")\n" << std::endl;
+                    usage(false);
+                    return false;
+                }
+            }
+
+            // Options that run a benchmark of their own replace the write and read passes, so they exclude each other
+            // and the options that only shape those passes; a few pass options also replace one another. Reject such
+            // combinations rather than silently ignoring one side.
+            struct Conflict { const char *a, *b; std::string why; };
+            std::vector<Conflict> conflicts = {
+                { "--syncrange", "--prealloc", "the streaming writer does not preallocate" },
+                { "--syncrange", "--compress", "the streaming writer does not generate data profiles" },
+                { "--syncrange", "--dedupe", "the streaming writer does not generate data profiles" },
+                { "--syncrange", "--fragment", "the streaming writer has no filler file" },
+                { "--syncrange", "--record", "the streaming writer is not recorded" },
+                { "--syncrange", "--polled", "the streaming writer goes through the page cache, nothing to poll" },
+                { "--scale", "--replay", "both replace the read pass" },
+                { "--replay", "--pattern", "the trace gives the offsets" },
+            };
+            const char *exclusive[] = { "--metadata", "--target", "--buffered", "--stalls", "--append", "--tail" };
+            const char *passOnly[] = { "--prealloc", "--overwrite", "--discard", "--syncrange", "--copy", "--scale",
+                                       "--replay", "--record", "--compress", "--dedupe", "--fragment", "--extents" };
+            // the I/O options the standalone modes ignore too (--target alone issues its I/O like the passes do)
+            const char *ioOpts[] = { "--pattern", "--iovecs", "--polled" };
+            for (size_t m = 0; m < std::size(exclusive); ++m) {
+                for (size_t n = m + 1; n < std::size(exclusive); ++n)
+                    conflicts.push_back({ exclusive[m], exclusive[n], "each runs a benchmark of its own" });
+                for (const char *opt : passOnly)
+                    conflicts.push_back({ exclusive[m], opt,
+                                          std::string(exclusive[m]) + " replaces the write and read passes" });
+                conflicts.push_back({ exclusive[m], "--counters",
+                                      std::string(exclusive[m]) + " collects no counters" });
+                if (std::string(exclusive[m]) != "--target")
+                    for (const char *opt : ioOpts)
+                        conflicts.push_back({ exclusive[m], opt, std::string(exclusive[m]) + " issues its own I/O" });
+            }
+            // and modifiers that only mean something with another option
+            const std::pair<const char *, const char *> needs[] = {
+                { "--faithful", "--replay" },
+                { "--reserve", "--append" },
+                { "--segment", "--append" },
+                { "--fsync", "--append" },
+            };
+            for (const auto & c : conflicts)
+                if (given.count(c.a) && given.count(c.b)) {
+                    std::cerr << "Conflicting options " << c.a << " and " << c.b << " (" << c.why << ")\n" << std::endl;
+                    usage(false);
+                    return false;
+                }
+            for (const auto & r : needs)
+                if (given.count(r.first) && !given.count(r.second)) {
+                    std::cerr << "Option " << r.first << " requires " << r.second << "\n" << std::endl;
+                    usage(false);
+                    return false;
+                }
+
+            const int nargs = argc - i;
+            if (nargs < 1 || nargs > 2) {
                 usage();
                 return false;
             }
 
             // parse outfile
-            p.outfile = argv[1];
+            p.outfile = argv[i];
 
             if (!p.outfile.length() || p.outfile[0] == '-') {
                 usage();
@@ -252,16 +311,9 @@ namespace {
             }
 
             // parse MB
-            if (argc > 2) {
+            if (nargs > 1) {
                 try {
-                    size_t pos = 0;
-                    std::string s(argv[2]);
-                    long mb = std::stol(s, &pos);
-                    if (mb <= 0)
-                        throw std::runtime_error("must be >= 0");
-                    if (pos < s.length())
-                        throw std::runtime_error("extra characters at end of string");
-                    p.mb = mb;
+                    p.mb = parsePositive(argv[i+1]);
                 } catch (const std::exception & e) {
                     std::cerr << "Failed to parse SIZE_MB (" << e.what() << ")\n" << std::endl;
                     usage(false);
@@ -276,13 +328,4 @@ namespace {
         return p;
     }
 
-    double getTime()
-    {
-        static auto t0 = std::chrono::high_resolution_clock::now();
-
-        auto now = std::chrono::high_resolution_clock::now();
-        std::chrono::duration<double> diff = now-t0;
-        return diff.count();
-    }
-
 } // end anonymous namespace
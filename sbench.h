@@ -0,0 +1,258 @@
+// libsbench: the benchmark engine behind the sbench command line tool, usable in-process. Fill in a Context (each
+// field mirrors a command line option and obeys the same limits) and call run() for the full sequence of passes the
+// tool runs, or one of the phase functions on its own. With Context::results set, every phase's figures are collected
+// there as PhaseResult structs. Human-readable progress goes to the stream given to setOutput() (stdout by default),
+// errors to stderr. Phase functions return 0 on success, 99 if interrupted, and another nonzero code on error.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace sbench {
+    // define some constants we use
+    constexpr size_t MB = 1024*1024;
+    constexpr size_t BUFSZ = MB; // size of each request of the read and write passes
+    constexpr size_t DATA_CHUNK = 4096; // granularity of the generated write data (--compress/--dedupe)
+    constexpr const char *VER = "1.2"; // program version
+
+    // offset distribution for the read pass (--pattern=...), parsed from e.g. "zipf:0.99" or "hotcold:90:10"
+    struct AccessPattern
+    {
+        enum Kind { Seq, Uniform, Zipf, Pareto, HotCold, Gauss };
+        Kind kind = Seq;
+        double a = 0., b = 0.; // distribution parameters, see parse()
+
+        static AccessPattern parse(const std::string & spec); // throws std::runtime_error on bad input
+        std::string describe() const;
+    };
+
+    // One I/O of a trace file. The on-disk format is text, one I/O per line:
+    //     TIMESTAMP_SECS OP OFFSET LENGTH [THREAD]
+    // where OP is R or W, THREAD is an arbitrary id, and lines starting with '#' are comments. That is easy to produce
+    // from blkparse or strace output with a one-line awk script, and is what --record writes.
+    struct TraceRecord
+    {
+        double ts;
+        std::uint64_t offset;
+        std::uint64_t length;
+        char op; // 'R' or 'W'
+        std::uint32_t thread;
+    };
+
+    // loads a trace file, throws std::runtime_error naming the offending line on bad input
+    std::vector<TraceRecord> loadTrace(const std::string & path);
+
+    // collects the I/O stream of the read and write passes for --record, written out at the end of the run
+    class TraceRecorder
+    {
+    public:
+        void add(double ts, char op, std::uint64_t offset, std::uint64_t length) { recs.push_back({ts, offset, length, op, 0}); }
+        bool save(const std::string & path) const;
+
+    private:
+        std::vector<TraceRecord> recs;
+    };
+
+    // how doWrite() lays out the file before writing it (--prealloc=...)
+    enum class Prealloc { Extend, Sparse, Alloc, KeepSize, ZeroRange };
+
+    // which write pass doWrite() runs: the initial one into a truncated file, overwriting its blocks in place, or
+    // rewriting it sequentially after doDiscard() deallocated them
+    enum class WritePass { Fresh, OverwriteSeq, OverwriteRandom, AfterDiscard };
+
+    class ResultsLog;
+
+    struct Context
+    {
+        std::string outfile;
+        size_t mb = 2*1024;  // 2 GB default size
+        bool valid = false, outfileCreated = false;
+        bool counters = false; // --counters: collect performance counters around each phase
+        bool polled = false; // --polled: polled completions (RWF_HIPRI) for the read and write loops
+        size_t iovecs = 1; // --iovecs=N: compose each BUFSZ request of N scattered buffers (vectored I/O)
+        AccessPattern pattern; // --pattern=...: offsets for the read pass, sequential by default
+        std::string replayFile; // --replay=FILE: replay this trace instead of the read pass
+        bool faithful = false; // --faithful: honor trace timestamps rather than replaying as fast as possible
+        std::string recordFile; // --record=FILE: record the write and read passes to a trace file
+        std::shared_ptr<TraceRecorder> recorder; // set up by run() when recordFile is given
+        size_t threads = 1; // --threads=N: worker threads for the multi-threaded workloads
+        size_t metadataFiles = 0; // --metadata=N: run the small-file metadata benchmark on N files instead
+        double compress = 1.; // --compress=R: write data compressible at about R:1
+        double dedupe = 0.; // --dedupe=PCT: percentage of written 4 KB chunks that duplicate earlier ones
+        Prealloc prealloc = Prealloc::Extend; // --prealloc=MODE: extending writes by default
+        bool preallocCompare = false; // --prealloc=compare: run the write pass once per mode and compare
+        bool overwrite = false; // --overwrite: follow the write pass with sequential and random in-place overwrites
+        size_t discardChunkMB = 0; // --discard[=MB]: discard the test region in chunks of this size, then rewrite it
+        bool extents = false; // --extents: report the file's extent layout after the write passes
+        size_t fragmentMB = 0; // --fragment=MB: fragment the file by writing 1 MB of filler after every MB of it
+        double progressInterval = 0.; // --progress[=SECS]: print live progress this often, 0 = off
+        size_t syncRangeMB = 0; // --syncrange[=MB]: buffered streaming write pass, syncing every MB behind the writer
+        bool copy = false; // --copy: after the write passes, copy the file with read()+write() and each zero-copy call
+        bool memBandwidth = false; // --membw: measure memory bandwidth first, and relate I/O throughput to it
+        double stallSecs = 0.; // --stalls[=MS]: buffered write-back stall workload, reporting writes slower than this
+        size_t appendRecord = 0; // --append[=BYTES]: append-only log workload with records of this size, 0 = off
+        bool appendReserve = false; // --reserve: reserve append offsets with fetch_add and pwrite() them, not O_APPEND
+        size_t segmentMB = 64; // --segment=MB: roll the log over to a new segment file at this size
+        double appendSyncSecs = 0.; // --fsync=MS: fsync the active log segment this often, 0 = never
+        bool tail = false; // --tail: read-after-write probe, --threads readers following a single writer
+        bool buffered = false; // --buffered: page-cache write-back and cached-read passes instead of direct I/O
+        size_t scaleMax = 0; // --scale=MAX...: replace the read pass with a saturation search up to MAX threads
+        double scaleMinGain = 10.; // stop the search when doubling the threads gains less than this percentage
+        double scaleP99Limit = 0.; // or when p99 latency exceeds this many seconds, 0 = no limit
+        std::vector<std::string> targets; // --target=FILE: further files written and read concurrently with outfile
+        std::string resultsFile; // --results=FILE: write every phase's results to FILE as JSON
+        std::shared_ptr<ResultsLog> results; // set up by run() when resultsFile is given, or by
+                                             // the caller to collect results in-process
+
+        operator bool() const { return valid; }
+    };
+
+    // snapshot of process CPU time and context switches, taken around each benchmark phase
+    struct CpuUsage
+    {
+        double user = 0., sys = 0.; // seconds
+        long volCsw = 0, involCsw = 0; // voluntary and involuntary context switches
+
+        static CpuUsage now();
+        CpuUsage operator-(const CpuUsage & o) const;
+    };
+
+    // cumulative progress of a phase at time t (seconds into it), sampled by ProgressReporter
+    struct ProgressSample
+    {
+        double t;
+        std::uint64_t bytes, ops;
+    };
+
+    // Latency histogram with 16 linear sub-buckets per power of two of nanoseconds (HdrHistogram-style), so
+    // add() is O(1) and allocation free and percentiles are accurate to within ~6% at any scale.
+    class LatencyHistogram
+    {
+    public:
+        void add(double secs);
+        size_t count() const { return n; }
+        double lowest() const { return min; }
+        double highest() const { return max; }
+        double mean() const { return n ? sum / n : 0.; }
+        double percentile(double pct) const; // in seconds
+        void merge(const LatencyHistogram & o);
+        void print(const char *label = "Latency") const;
+
+    private:
+        static constexpr int SUB_BITS = 4, SUB = 1 << SUB_BITS;
+        std::uint64_t buckets[64 * SUB] = {};
+        size_t n = 0;
+        double sum = 0., min = 0., max = 0.;
+
+        static int bucketOf(std::uint64_t ns);
+        static double valueOf(int bucket); // midpoint of the bucket, in nanoseconds
+    };
+
+    // one sampling interval of the write-back stall workload (--stalls), ending t seconds into it
+    struct WritebackSample
+    {
+        double t;
+        std::uint64_t bytes; // written by the benchmark during the interval
+        double maxLatency; // of its writes, seconds
+        size_t stalls; // writes slower than the stall threshold
+        std::uint64_t dirty, writeback, flushed, threshold; // bytes: nr_dirty, nr_writeback, nr_written delta, limit
+    };
+
+    // Summary of one phase, logged for --results. When an interrupt cut the phase short, partial is set and the
+    // figures cover only the portion completed before it.
+    struct PhaseResult
+    {
+        std::string name;
+        double secs = 0., mbPerSec = 0.;
+        std::uint64_t bytes = 0, ops = 0;
+        bool partial = false;
+        CpuUsage cpu;
+        LatencyHistogram lat;
+        std::vector<ProgressSample> series; // only with --progress
+        std::vector<WritebackSample> writeback; // only for --stalls
+    };
+
+    // Measurements of the measuring apparatus itself, taken once on first use (run() prints them). getTime() uses the
+    // TSC when it is invariant and (on Linux) trusted by the kernel as its clocksource, else CLOCK_MONOTONIC_RAW, and
+    // clockRead is subtracted from every latency sample.
+    struct Calibration
+    {
+        std::string clock; // "tsc" or "monotonic_raw"
+        double clockHz = 0.; // tick rate of the clock
+        double clockRead = 0., clockResolution = 0.; // cost of one read and smallest step seen between reads, seconds
+        double nullSyscall = 0.; // cost of getppid(), seconds
+        double memcpyBytesPerSec = 0.; // memcpy bandwidth in BUFSZ blocks, larger than the caches
+    };
+    const Calibration & calibration();
+
+    // Physical layout of a file on its device. Extents that start exactly where the previous one ended on the device
+    // belong to the same contiguous run, so runs == 1 means the file is unfragmented however many extents the
+    // filesystem split it into.
+    struct ExtentLayout
+    {
+        size_t extents = 0, runs = 0;
+        std::uint64_t bytes = 0; // mapped, i.e. excluding holes
+
+        double avgExtent() const { return extents ? double(bytes) / extents : 0.; }
+        double avgRun() const { return runs ? double(bytes) / runs : 0.; }
+    };
+    // from FIEMAP on Linux or F_LOG2PHYS_EXT on macOS (which reports whole runs, so there extents == runs); returns
+    // false with errno set if the platform or filesystem cannot tell
+    bool extentLayout(const std::string & path, ExtentLayout & layout);
+
+    // collects the PhaseResult of every phase; for --results, run() writes it as JSON on return, interrupted or not
+    class ResultsLog
+    {
+    public:
+        void add(const PhaseResult & r) { list.push_back(r); }
+        const std::vector<PhaseResult> & phases() const { return list; }
+        void setLayout(const ExtentLayout & l) { ext = l; } // with --extents, as measured after the write passes
+        const ExtentLayout & layout() const { return ext; }
+        bool save(const std::string & path, const Context & p) const;
+
+    private:
+        std::vector<PhaseResult> list;
+        ExtentLayout ext;
+    };
+
+    const char *preallocName(Prealloc mode);
+    // modes usable on this platform, in the order --prealloc=compare runs them
+    std::vector<Prealloc> preallocModes();
+
+    // true if Context::polled can be set, i.e. the platform has RWF_HIPRI
+    bool polledSupported();
+
+    // Runs what the command line tool runs for p: the write pass(es), then the read pass or trace replay, or just the
+    // metadata, multi-target, buffered, write-back stall, append log or read-after-write benchmark. The test file (or
+    // tree) is removed when it returns.
+    int run(Context & p);
+
+    // the individual phases, for callers composing their own sequence (doWrite() creates the file, the rest expect it)
+    int doRead(const Context & p);
+    int doWrite(Context & p, PhaseResult *result = nullptr, WritePass pass = WritePass::Fresh);
+    int doReplay(const Context & p);
+    int doDiscard(const Context & p);
+    int doMetadata(const Context & p);
+    int doSyncRangeWrite(Context & p); // used by run() instead of doWrite() when syncRangeMB is set
+    int doCopy(const Context & p);
+    int doMemBandwidth(const Context & p);
+    int doBuffered(Context & p);
+    int doStalls(Context & p);
+    int doAppendLog(Context & p); // M threads appending to rolling segment files OUTFILE.0, OUTFILE.1...
+    int doTail(Context & p); // one writer, Context::threads readers reading back each block as soon as it is written
+    int doScale(const Context & p);
+    int doTargets(const Context & p); // writes and reads outfile and every Context::targets file concurrently
+
+    // Asks the running phases to stop after their I/O in flight, reporting partial results; safe to call from a
+    // signal handler or another thread. The request stays in effect until clearInterrupt().
+    void interrupt();
+    bool isInterrupted();
+    void clearInterrupt();
+
+    // where progress messages and per-phase figures are printed, nullptr to discard them; set it before running
+    void setOutput(std::ostream *os);
+} // end namespace sbench